@@ -44,19 +44,19 @@ GDT64:                           ; Global Descriptor Table (64-bit).
     db 10010011b                 ; Access (read/write).
     db 11001111b                 ; Granularity.
     db 0                         ; Base (high).
-    .UserCode: equ $ - GDT64     ; The user code descriptor.
+    .UserData: equ $ - GDT64     ; The user data descriptor, sysret wants it right before user code.
     dw 0xFFFF                    ; Limit (low).
     dw 0                         ; Base (low).
     db 0                         ; Base (middle)
-    db 11111101b                 ; Access (exec/read).
-    db 10101111b                 ; Granularity, 64 bits flag, limit19:16.
+    db 11110011b                 ; Access (read/write).
+    db 11001111b                 ; Granularity.
     db 0                         ; Base (high).
-    .UserData: equ $ - GDT64     ; The user data descriptor.
+    .UserCode: equ $ - GDT64     ; The user code descriptor.
     dw 0xFFFF                    ; Limit (low).
     dw 0                         ; Base (low).
     db 0                         ; Base (middle)
-    db 11110011b                 ; Access (read/write).
-    db 11001111b                 ; Granularity.
+    db 11111101b                 ; Access (exec/read).
+    db 10101111b                 ; Granularity, 64 bits flag, limit19:16.
     db 0                         ; Base (high).
     .Code32: equ $ - GDT64       ; The 32 bit code descriptor for SMP core booting.
     dq 0x00CF9A000000FFFF
@@ -97,7 +97,7 @@ loaded_cs:
     mov ds, ax
     mov es, ax
     mov ss, ax
-    mov ax, 0x20
+    mov ax, 0x18 ; User data
     mov gs, ax
     mov fs, ax
 
@@ -80,14 +80,13 @@ void debug_worker() {
                 // Send a list of thread names
                 char *data = kcalloc(1);
                 interrupt_safe_lock(sched_lock);
-                for (uint64_t i = 0; i < threads_list_size; i++) {
-                    
-                    if (threads[i]) {
-                        thread_t *task = threads[i];
-                        data = krealloc(data, strlen(data) + 3 + strlen(task->name));
-                        strcat(data, "+=");
-                        strcat(data, task->name);
-                    }
+                int64_t i = 0;
+                thread_t *task;
+                while ((task = idr_get_next(&thread_ids, &i))) {
+                    data = krealloc(data, strlen(data) + 3 + strlen(task->name));
+                    strcat(data, "+=");
+                    strcat(data, task->name);
+                    i++;
                 }
                 interrupt_safe_unlock(sched_lock);
                 dripdbg_send(data);
@@ -96,15 +95,15 @@ void debug_worker() {
                 // Send a list of task ids
                 char *data = kcalloc(1);
                 interrupt_safe_lock(sched_lock);
-                for (uint64_t i = 0; i < threads_list_size; i++) {
-                    if (threads[i]) {
-                        thread_t *task = threads[i];
-                        char id[30];
-                        utoa(task->tid, id);
-                        data = krealloc(data, strlen(data) + 3 + strlen(id));
-                        strcat(data, "+=");
-                        strcat(data, id);
-                    }
+                int64_t i = 0;
+                thread_t *task;
+                while ((task = idr_get_next(&thread_ids, &i))) {
+                    char id[30];
+                    utoa(task->tid, id);
+                    data = krealloc(data, strlen(data) + 3 + strlen(id));
+                    strcat(data, "+=");
+                    strcat(data, id);
+                    i++;
                 }
                 interrupt_safe_unlock(sched_lock);
                 dripdbg_send(data);
@@ -115,7 +114,7 @@ void debug_worker() {
                 uint64_t cur_buf_size = 1;
                 uint64_t tid = atou(buffer + 1);
                 interrupt_safe_lock(sched_lock);
-                thread_t *task = threads[tid];
+                thread_t *task = get_thread(tid);
 
                 // Get the data together
                 data = dripdbg_add_list_int(data, task->regs.rax, &cur_buf_size);
@@ -150,7 +149,7 @@ void debug_worker() {
                 uint64_t tid = atou(buffer + 1);
 
                 interrupt_safe_lock(sched_lock);
-                thread_t *task = threads[tid];
+                thread_t *task = get_thread(tid);
 
                 data = dripdbg_add_list_int(data, task->tsc_started, &cur_buf_size);
                 data = dripdbg_add_list_int(data, task->tsc_stopped, &cur_buf_size);
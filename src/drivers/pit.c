@@ -5,16 +5,19 @@
 #include "drivers/tty/tty.h"
 #include "klibc/stdlib.h"
 #include "proc/scheduler.h"
-#include "proc/sleep_queue.h"
-
-volatile uint64_t global_ticks = 0;
+#include "sys/timekeeping.h"
+#include "sys/lapic_timer.h"
+#include "sys/ktimer.h"
 
 void timer_handler(int_reg_t *r) {
-    global_ticks++;
-    advance_time(); // Sleep queue
-
-    if (global_ticks % sched_period == 0 && scheduler_enabled) {
-        schedule_bsp(r);
+    timekeeping_tick();
+
+    /* Each CPU normally runs its own timers and scheduler from its LAPIC timer */
+    if (!lapic_timer_enabled()) {
+        ktimer_run_expired();
+        if (timekeeper.ticks % sched_period == 0 && scheduler_enabled) {
+            schedule_tick(r);
+        }
     }
 }
 
@@ -32,15 +35,22 @@ void set_pit_freq() {
     port_outb(0x40, high); /* High byte of the frequency */
 }
 
+/* Put channel 0 in one-shot mode so it stops firing */
+void pit_stop() {
+    port_outb(0x43, 0x30); /* Channel 0, lobyte/hibyte, interrupt on terminal count */
+    port_outb(0x40, 0xFF);
+    port_outb(0x40, 0xFF);
+}
+
 void sleep_no_task(uint64_t ticks) {
-    volatile uint64_t start_ticks = global_ticks;
-    while (global_ticks < ticks + start_ticks) asm volatile("pause");
+    uint64_t start_ticks = get_ticks();
+    while (get_ticks() < ticks + start_ticks) asm volatile("pause");
 }
 
 uint64_t stopwatch_start() {
-    return global_ticks;
+    return get_ticks();
 }
 
 uint64_t stopwatch_stop(uint64_t start) {
-    return (global_ticks - start);
+    return (get_ticks() - start);
 }
\ No newline at end of file
@@ -169,7 +169,7 @@ uint64_t rtc_time_to_seconds(rtc_time_t time) {
     return sec;
 }
 
-uint64_t get_time_since_epoch() {
+uint64_t rtc_get_time_since_epoch() {
     rtc_time_t current_time = read_rtc();
     rtc_time_t epoch_time = {0, 0, 0, 5, 1, 1, 70, 19};
     uint64_t current_seconds = rtc_time_to_seconds(current_time);
@@ -15,6 +15,6 @@ typedef struct {
 
 rtc_time_t read_rtc();
 void write_rtc(rtc_time_t to_write);
-uint64_t get_time_since_epoch();
+uint64_t rtc_get_time_since_epoch();
 
 #endif
\ No newline at end of file
@@ -215,7 +215,7 @@ void vesa_ipc_server() {
             }
 
             interrupt_safe_lock(sched_lock);
-            process_t *target_process = processes[handle->pid];
+            process_t *target_process = get_process(handle->pid);
             interrupt_safe_unlock(sched_lock);
 
             /* Map framebuffer into the process */
@@ -11,6 +11,11 @@
 
 lock_t fd_lock = {0, 0, 0, 0};
 
+DEFINE_PER_CPU_COUNTER(io_read_count);
+DEFINE_PER_CPU_COUNTER(io_read_bytes);
+DEFINE_PER_CPU_COUNTER(io_write_count);
+DEFINE_PER_CPU_COUNTER(io_write_bytes);
+
 int fd_open(char *filepath, int mode) {
     char *kernel_string = check_and_copy_string(filepath);
     if (!kernel_string) { // if err
@@ -88,6 +93,10 @@ int fd_read(int fd, void *buf, uint64_t count) {
     int read = vfs_read(fd, buf, count);
     if (set_ignore)
         get_cpu_locals()->ignore_ring = 0;
+    percpu_counter_inc(io_read_count);
+    if (read > 0) {
+        percpu_counter_add(io_read_bytes, read);
+    }
     //sprintf("got past vfs_read\n");
     return read;
 }
@@ -115,6 +124,10 @@ int fd_write(int fd, void *buf, uint64_t count) {
     int ret = vfs_write(fd, buf, count);
     if (set_ignore)
         get_cpu_locals()->ignore_ring = 0;
+    percpu_counter_inc(io_write_count);
+    if (ret > 0) {
+        percpu_counter_add(io_write_bytes, ret);
+    }
     return ret;
 }
 
@@ -155,10 +168,10 @@ uint64_t fd_seek(int fd, uint64_t offset, int whence) {
 
 int fd_new(vfs_node_t *node, int mode, int pid) {
     interrupt_safe_lock(sched_lock);
-    if ((uint64_t) pid >= process_list_size) {
+    process_t *current_process = get_process(pid);
+    if (!current_process) {
         sprintf("ERRRRRRRRRRRRRROR in fd_new: pid bad: %d\n", pid);
     }
-    process_t *current_process = processes[pid];
     interrupt_safe_unlock(sched_lock);
 
     lock(fd_lock);
@@ -189,7 +202,7 @@ fnd:
 
 void fd_remove(int fd) {
     interrupt_safe_lock(sched_lock);
-    process_t *current_process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *current_process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
 
     lock(fd_lock);
@@ -208,7 +221,7 @@ fd_entry_t *fd_lookup(int fd) {
     fd_entry_t *ret;
 
     interrupt_safe_lock(sched_lock);
-    process_t *current_process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *current_process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
 
     lock(fd_lock);
@@ -227,11 +240,11 @@ fd_entry_t *fd_lookup(int fd) {
 
 void clone_fds(int64_t old_pid, int64_t new_pid) {
     interrupt_safe_lock(sched_lock);
-    if ((uint64_t) old_pid >= process_list_size || (uint64_t) new_pid >= process_list_size) {
+    process_t *old = get_process(old_pid);
+    process_t *new = get_process(new_pid);
+    if (!old || !new) {
         sprintf("BAD ERROR REEEEEEEEEEEEEEEEEEEEEE (go look in clone_fds) old_pid: %ld, new_pid: %ld\n", old_pid, new_pid);
     }
-    process_t *old = processes[old_pid];
-    process_t *new = processes[new_pid];
     interrupt_safe_unlock(sched_lock);
 
 
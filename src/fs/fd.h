@@ -2,6 +2,7 @@
 #define FS_FD_H
 #include <stdint.h>
 #include "vfs/vfs.h"
+#include "sys/percpu.h"
 
 #define SEEK_CUR 1
 #define SEEK_END 2
@@ -31,4 +32,10 @@ int open_remote_fd(char *name, int mode, int pid);
 
 void clone_fds(int64_t old_pid, int64_t new_pid);
 
+/* Reads and writes that went through an fd, and how many bytes they moved */
+DECLARE_PER_CPU_COUNTER(io_read_count);
+DECLARE_PER_CPU_COUNTER(io_read_bytes);
+DECLARE_PER_CPU_COUNTER(io_write_count);
+DECLARE_PER_CPU_COUNTER(io_write_bytes);
+
 #endif
\ No newline at end of file
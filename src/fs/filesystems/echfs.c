@@ -13,7 +13,7 @@
 #include "mm/pmm.h"
 
 #include "drivers/pit.h"
-#include "drivers/rtc.h"
+#include "sys/timekeeping.h"
 
 #include "drivers/serial.h"
 #include "proc/scheduler.h"
@@ -34,12 +34,18 @@
 #include "klibc/string.h"
 #include "klibc/math.h"
 #include "sys/smp.h"
+#include "sys/timekeeping.h"
+#include "sys/percpu.h"
+#include "sys/lapic_timer.h"
+#include "sys/topology.h"
 
 #include "fs/filesystems/echfs.h"
 #include "proc/exec_formats/elf.h"
 #include "proc/event.h"
-#include "proc/urm.h"
+#include "proc/fpu.h"
+#include "proc/workqueue.h"
 #include "proc/ipc.h"
+#include "proc/syscall_bench.h"
 
 #define TODO_LIST_SIZE 1
 char *todo_list[TODO_LIST_SIZE] = {"git gud"};
@@ -81,6 +87,10 @@ void kernel_process(int argc, char **argv, auxv_t *auxv) {
     setup_drip_dgb();
 #endif
 
+#ifdef SYSCALL_BENCH
+    launch_syscall_bench();
+#endif
+
     kill_task(get_cpu_locals()->current_thread->tid); // suicide
     sprintf("WHY DID THIS RETURN!?\n");
 }
@@ -101,9 +111,8 @@ void kernel_task() {
 
     kprintf("Setting up PID 0...\n");
     new_kernel_process("Kernel process", kernel_process);
-    kprintf("Starting URM...\n");
-    thread_t *urm = create_thread("URM", urm_thread, (uint64_t) kcalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE, 0);
-    add_new_child_thread(urm, 0);
+    kprintf("Starting workers...\n");
+    workqueue_init();
 
     kill_task(get_cpu_locals()->current_thread->tid); // suicide
     sprintf("WHY DID THIS RETURN 2!?\n");
@@ -138,6 +147,7 @@ void kmain(stivale_info_t *bootloader_info) {
     get_cpu_locals()->apic_id = get_lapic_id();
     get_cpu_locals()->cpu_index = 0;
     hashmap_set_elem(cpu_locals_list, 0, get_cpu_locals());
+    percpu_init(0);
 
     load_tss();
     set_panic_stack((uint64_t) kmalloc(0x1000) + 0x1000);
@@ -147,13 +157,16 @@ void kmain(stivale_info_t *bootloader_info) {
     configure_idt();
     sprintf("[DripOS] Setting timer speed to 1000 hz.\n");
     set_pit_freq();
+    timekeeping_init();
+    lapic_timer_init();
     sprintf("[DripOS] Timers set.\n");
+    fpu_init_cpu();
+    topology_init_cpu();
 
     sprintf("[DripOS] Set kernel stacks.\n");
     scheduler_init_bsp();
 
-    thread_t *kernel_thread = create_thread("Kernel setup worker", kernel_task, 
-        (uint64_t) kmalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE, 0);
+    thread_t *kernel_thread = create_kthread("Kernel setup worker", kernel_task);
     start_thread(kernel_thread);
 
     sprintf("[DripOS] Launched kernel thread, scheduler disabled...\n");
@@ -166,6 +179,10 @@ void kmain(stivale_info_t *bootloader_info) {
 
     tty_clear(&base_tty);
 
+    if (lapic_timer_enabled()) {
+        timekeeping_stop_tick(); // Every CPU drives its own timers from here on
+    }
+
     sprintf("[DripOS] Loading scheduler...\n");
     scheduler_enabled = 1;
 
@@ -0,0 +1,153 @@
+#include "idr.h"
+#include "klibc/stdlib.h"
+
+static idr_node_t *idr_new_node(uint8_t shift) {
+    idr_node_t *node = kcalloc(sizeof(idr_node_t));
+    node->free = 0xFFFFFFFFFFFFFFFF;
+    node->shift = shift;
+    return node;
+}
+
+/* Largest ID that fits under a node */
+static inline uint64_t idr_node_max(idr_node_t *node) {
+    uint8_t bits = node->shift + IDR_BITS;
+    return bits >= 64 ? 0xFFFFFFFFFFFFFFFF : (1ULL << bits) - 1;
+}
+
+/* Store ptr at the lowest free ID and return it */
+int64_t idr_alloc(idr_t *idr, void *ptr) {
+    idr_node_t *path[64 / IDR_BITS + 1];
+    int depth = 0;
+
+    lock(idr->lock);
+    if (!idr->root) {
+        idr->root = idr_new_node(0);
+    }
+    if (!idr->root->free) {
+        /* Full, add a level on top. Readers see either the old or new root, both are valid. */
+        idr_node_t *new_root = idr_new_node(idr->root->shift + IDR_BITS);
+        new_root->slots[0] = idr->root;
+        new_root->free &= ~1ULL;
+        asm volatile("" ::: "memory");
+        idr->root = new_root;
+    }
+
+    uint64_t id = 0;
+    idr_node_t *node = idr->root;
+    while (node->shift) {
+        int slot = __builtin_ctzll(node->free);
+        idr_node_t *child = node->slots[slot];
+        if (!child) {
+            child = idr_new_node(node->shift - IDR_BITS);
+            asm volatile("" ::: "memory");
+            node->slots[slot] = child;
+        }
+        id |= (uint64_t) slot << node->shift;
+        path[depth++] = node;
+        node = child;
+    }
+
+    int slot = __builtin_ctzll(node->free);
+    id |= slot;
+    asm volatile("" ::: "memory");
+    node->slots[slot] = ptr;
+    node->free &= ~(1ULL << slot);
+
+    /* Let the parents know if we filled their subtree */
+    while (!node->free && depth) {
+        node = path[--depth];
+        node->free &= ~(1ULL << ((id >> node->shift) & IDR_MASK));
+    }
+    unlock(idr->lock);
+    return (int64_t) id;
+}
+
+/* Lockless, the entry can be removed under us but the memory stays valid */
+void *idr_find(idr_t *idr, int64_t id) {
+    idr_node_t *node = idr->root;
+    if (!node || id < 0 || (uint64_t) id > idr_node_max(node)) {
+        return (void *) 0;
+    }
+
+    while (node->shift) {
+        node = node->slots[(id >> node->shift) & IDR_MASK];
+        if (!node) {
+            return (void *) 0;
+        }
+    }
+    return node->slots[id & IDR_MASK];
+}
+
+/* Free an ID, returns what was stored there */
+void *idr_remove(idr_t *idr, int64_t id) {
+    idr_node_t *path[64 / IDR_BITS + 1];
+    int depth = 0;
+    void *ret = (void *) 0;
+
+    lock(idr->lock);
+    idr_node_t *node = idr->root;
+    if (!node || id < 0 || (uint64_t) id > idr_node_max(node)) {
+        goto done;
+    }
+
+    while (node->shift) {
+        path[depth++] = node;
+        node = node->slots[(id >> node->shift) & IDR_MASK];
+        if (!node) {
+            goto done;
+        }
+    }
+
+    ret = node->slots[id & IDR_MASK];
+    if (ret) {
+        node->slots[id & IDR_MASK] = (void *) 0;
+        node->free |= 1ULL << (id & IDR_MASK);
+        while (depth) {
+            node = path[--depth];
+            node->free |= 1ULL << ((id >> node->shift) & IDR_MASK);
+        }
+    }
+
+done:
+    unlock(idr->lock);
+    return ret;
+}
+
+/* Find the first entry at or after *id, and update *id to its ID. NULL once there are no more. */
+void *idr_get_next(idr_t *idr, int64_t *id) {
+    idr_node_t *root = idr->root;
+    if (!root || *id < 0) {
+        return (void *) 0;
+    }
+
+    uint64_t max = idr_node_max(root);
+    uint64_t cur = (uint64_t) *id;
+    while (cur <= max) {
+        idr_node_t *node = root;
+        while (node->shift) {
+            idr_node_t *child = node->slots[(cur >> node->shift) & IDR_MASK];
+            if (!child) {
+                break;
+            }
+            node = child;
+        }
+
+        if (node->shift) {
+            /* Nothing under this slot, skip past it */
+            uint64_t next = ((cur >> node->shift) + 1) << node->shift;
+            if (next <= cur) {
+                break; // Wrapped
+            }
+            cur = next;
+            continue;
+        }
+
+        void *ret = node->slots[cur & IDR_MASK];
+        if (ret) {
+            *id = (int64_t) cur;
+            return ret;
+        }
+        cur++;
+    }
+    return (void *) 0;
+}
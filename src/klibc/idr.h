@@ -0,0 +1,29 @@
+#ifndef KLIBC_IDR_H
+#define KLIBC_IDR_H
+#include <stdint.h>
+#include "klibc/lock.h"
+
+#define IDR_BITS 6
+#define IDR_SLOTS (1 << IDR_BITS)
+#define IDR_MASK (IDR_SLOTS - 1)
+
+/* ID allocator, a radix tree of 64 slot nodes. Each node keeps a bitmap of the
+   slots under it that still have room, so the lowest free ID is found in
+   O(log n). Nodes are never freed or moved, so lookups don't need the lock. */
+typedef struct idr_node {
+    void *volatile slots[IDR_SLOTS];
+    uint64_t free; // Bit set if the slot, or the subtree under it, has room
+    uint8_t shift; // 0 for leaves
+} idr_node_t;
+
+typedef struct {
+    idr_node_t *volatile root;
+    lock_t lock;
+} idr_t;
+
+int64_t idr_alloc(idr_t *idr, void *ptr);
+void *idr_find(idr_t *idr, int64_t id);
+void *idr_remove(idr_t *idr, int64_t id);
+void *idr_get_next(idr_t *idr, int64_t *id);
+
+#endif
@@ -53,6 +53,7 @@ uint8_t check_interrupts();
     lock_.lock_name = #lock_; \
     spinlock_lock(&lock_.lock_dat); \
     lock_.current_holder = __FUNCTION__; \
+    lock_.cpu_holding_lock = get_cpu_index(); \
     ret; \
 })
 
@@ -0,0 +1,286 @@
+#include "rbtree.h"
+
+static void rotate_left(rb_root_t *root, rb_node_t *x) {
+    rb_node_t *y = x->right;
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    if (!x->parent) {
+        root->root = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(rb_root_t *root, rb_node_t *x) {
+    rb_node_t *y = x->left;
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    if (!x->parent) {
+        root->root = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+    y->right = x;
+    x->parent = y;
+}
+
+static inline uint8_t color_of(rb_node_t *node) {
+    return node ? node->color : RB_BLACK; // NULL leaves are black
+}
+
+void rb_insert(rb_root_t *root, rb_node_t *node, rb_less_t less) {
+    rb_node_t *parent = (void *) 0;
+    rb_node_t *cur = root->root;
+    int leftmost = 1;
+
+    /* Equal keys go to the right, so they keep FIFO order */
+    while (cur) {
+        parent = cur;
+        if (less(node, cur)) {
+            cur = cur->left;
+        } else {
+            cur = cur->right;
+            leftmost = 0;
+        }
+    }
+
+    node->parent = parent;
+    node->left = (void *) 0;
+    node->right = (void *) 0;
+    node->color = RB_RED;
+
+    if (!parent) {
+        root->root = node;
+    } else if (less(node, parent)) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+
+    if (leftmost) {
+        root->leftmost = node;
+    }
+
+    /* Fix up the colors */
+    while (node != root->root && node->parent->color == RB_RED) {
+        rb_node_t *gparent = node->parent->parent;
+        if (node->parent == gparent->left) {
+            rb_node_t *uncle = gparent->right;
+            if (color_of(uncle) == RB_RED) {
+                node->parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+            } else {
+                if (node == node->parent->right) {
+                    node = node->parent;
+                    rotate_left(root, node);
+                }
+                node->parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                rotate_right(root, gparent);
+            }
+        } else {
+            rb_node_t *uncle = gparent->left;
+            if (color_of(uncle) == RB_RED) {
+                node->parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+            } else {
+                if (node == node->parent->left) {
+                    node = node->parent;
+                    rotate_right(root, node);
+                }
+                node->parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                rotate_left(root, gparent);
+            }
+        }
+    }
+    root->root->color = RB_BLACK;
+}
+
+/* Put new in the place of old in old's parent */
+static void transplant(rb_root_t *root, rb_node_t *old, rb_node_t *new) {
+    if (!old->parent) {
+        root->root = new;
+    } else if (old == old->parent->left) {
+        old->parent->left = new;
+    } else {
+        old->parent->right = new;
+    }
+    if (new) {
+        new->parent = old->parent;
+    }
+}
+
+static void erase_fixup(rb_root_t *root, rb_node_t *x, rb_node_t *parent) {
+    while (x != root->root && color_of(x) == RB_BLACK) {
+        if (x == parent->left) {
+            rb_node_t *sibling = parent->right;
+            if (color_of(sibling) == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (color_of(sibling->left) == RB_BLACK && color_of(sibling->right) == RB_BLACK) {
+                sibling->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (color_of(sibling->right) == RB_BLACK) {
+                    sibling->left->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rotate_right(root, sibling);
+                    sibling = parent->right;
+                }
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                if (sibling->right) {
+                    sibling->right->color = RB_BLACK;
+                }
+                rotate_left(root, parent);
+                x = root->root;
+            }
+        } else {
+            rb_node_t *sibling = parent->left;
+            if (color_of(sibling) == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (color_of(sibling->left) == RB_BLACK && color_of(sibling->right) == RB_BLACK) {
+                sibling->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (color_of(sibling->left) == RB_BLACK) {
+                    sibling->right->color = RB_BLACK;
+                    sibling->color = RB_RED;
+                    rotate_left(root, sibling);
+                    sibling = parent->left;
+                }
+                sibling->color = parent->color;
+                parent->color = RB_BLACK;
+                if (sibling->left) {
+                    sibling->left->color = RB_BLACK;
+                }
+                rotate_right(root, parent);
+                x = root->root;
+            }
+        }
+    }
+    if (x) {
+        x->color = RB_BLACK;
+    }
+}
+
+void rb_erase(rb_root_t *root, rb_node_t *node) {
+    if (root->leftmost == node) {
+        root->leftmost = rb_next(node);
+    }
+
+    rb_node_t *x;
+    rb_node_t *x_parent;
+    uint8_t removed_color = node->color;
+
+    if (!node->left) {
+        x = node->right;
+        x_parent = node->parent;
+        transplant(root, node, node->right);
+    } else if (!node->right) {
+        x = node->left;
+        x_parent = node->parent;
+        transplant(root, node, node->left);
+    } else {
+        /* Two children, swap in the successor */
+        rb_node_t *successor = node->right;
+        while (successor->left) {
+            successor = successor->left;
+        }
+        removed_color = successor->color;
+        x = successor->right;
+
+        if (successor->parent == node) {
+            x_parent = successor;
+        } else {
+            x_parent = successor->parent;
+            transplant(root, successor, successor->right);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
+
+        transplant(root, node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->color = node->color;
+    }
+
+    if (removed_color == RB_BLACK) {
+        erase_fixup(root, x, x_parent);
+    }
+
+    node->parent = (void *) 0;
+    node->left = (void *) 0;
+    node->right = (void *) 0;
+}
+
+rb_node_t *rb_first(rb_root_t *root) {
+    return root->leftmost;
+}
+
+rb_node_t *rb_last(rb_root_t *root) {
+    rb_node_t *cur = root->root;
+    if (!cur) {
+        return (void *) 0;
+    }
+    while (cur->right) {
+        cur = cur->right;
+    }
+    return cur;
+}
+
+rb_node_t *rb_next(rb_node_t *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    while (node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+rb_node_t *rb_prev(rb_node_t *node) {
+    if (node->left) {
+        node = node->left;
+        while (node->right) {
+            node = node->right;
+        }
+        return node;
+    }
+
+    while (node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+    return node->parent;
+}
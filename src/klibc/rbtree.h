@@ -0,0 +1,34 @@
+#ifndef KLIBC_RBTREE_H
+#define KLIBC_RBTREE_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+/* Intrusive red-black tree, embed an rb_node_t in whatever needs sorting */
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    uint8_t color;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t *root;
+    rb_node_t *leftmost; // Cached smallest node
+} rb_root_t;
+
+/* Returns non zero if a should be sorted before b */
+typedef int (*rb_less_t)(rb_node_t *a, rb_node_t *b);
+
+#define rb_entry(ptr, type, member) ((type *) ((uint8_t *) (ptr) - offsetof(type, member)))
+
+void rb_insert(rb_root_t *root, rb_node_t *node, rb_less_t less);
+void rb_erase(rb_root_t *root, rb_node_t *node);
+rb_node_t *rb_first(rb_root_t *root);
+rb_node_t *rb_last(rb_root_t *root);
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef KLIBC_SEQLOCK_H
+#define KLIBC_SEQLOCK_H
+#include <stdint.h>
+#include "klibc/lock.h"
+
+/* Sequence lock. Writers bump the sequence to an odd value while they update
+   the data, readers retry if the sequence was odd or changed under them. */
+typedef struct {
+    volatile uint32_t sequence;
+    lock_t write_lock;
+} seqlock_t;
+
+static inline void write_seqlock(seqlock_t *s) {
+    lock(s->write_lock);
+    s->sequence++;
+    asm volatile("" ::: "memory");
+}
+
+static inline void write_sequnlock(seqlock_t *s) {
+    asm volatile("" ::: "memory");
+    s->sequence++;
+    unlock(s->write_lock);
+}
+
+static inline uint32_t read_seqbegin(seqlock_t *s) {
+    uint32_t seq;
+    while ((seq = s->sequence) & 1) {
+        asm volatile("pause");
+    }
+    asm volatile("" ::: "memory");
+    return seq;
+}
+
+static inline int read_seqretry(seqlock_t *s, uint32_t seq) {
+    asm volatile("" ::: "memory");
+    return s->sequence != seq;
+}
+
+#endif
@@ -11,6 +11,7 @@
 #define stringify(x) stringify_param(x)
 #define assert(statement) do { if (!(statement)) { panic("Assert failed. File: " __FILE__ ", Line: " stringify(__LINE__) " Condition: assert(" #statement ");"); } } while (0)
 #define log_debug(msg) do { sprintf("File: " __FILE__ ", Line: " stringify(__LINE__) " [ Debug ] " msg "\n"); } while (0)
+#define container_of(ptr, type, member) ((type *) ((uint8_t *) (ptr) - __builtin_offsetof(type, member)))
 #define MALLOC_SIGNATURE 0xf100f333f100f333
 
 void *kmalloc(uint64_t size);
@@ -196,4 +196,30 @@ uint64_t pmm_get_used_mem() {
 
 uint64_t pmm_get_total_mem() {
     return total_memory;
-}
\ No newline at end of file
+}
+
+void pmm_batch_flush(pmm_batch_t *batch) {
+    if (!batch->count) {
+        return;
+    }
+    interrupt_state_t state = interrupt_lock();
+    lock(pmm_lock);
+
+    for (uint64_t i = 0; i < batch->count; i++) {
+        uint64_t page = (uint64_t) batch->pages[i] / 0x1000;
+        if (page >= bitmap_max_page) {
+            kprintf("trying to free bad memory: %lx\n", batch->pages[i]);
+            while (1) {
+                asm volatile("hlt");
+            }
+        }
+        pmm_clear_bit(page);
+    }
+
+    available_memory += batch->count * 0x1000;
+    used_memory -= batch->count * 0x1000;
+
+    unlock(pmm_lock);
+    interrupt_unlock(state);
+    batch->count = 0;
+}
@@ -8,6 +8,14 @@
 
 typedef void *symbol[];
 
+/* Single pages waiting to be freed together, so pmm_lock is taken once per batch */
+#define PMM_BATCH_SIZE 256
+
+typedef struct {
+    uint64_t count;
+    void *pages[PMM_BATCH_SIZE];
+} pmm_batch_t;
+
 extern symbol __kernel_end;
 extern symbol __kernel_start;
 extern symbol __kernel_code_start;
@@ -16,6 +24,14 @@ extern symbol __kernel_code_end;
 void pmm_memory_setup(stivale_info_t *bootloader_info);
 void *pmm_alloc(uint64_t size);
 void pmm_unalloc(void *addr, uint64_t size);
+void pmm_batch_flush(pmm_batch_t *batch);
+
+static inline void pmm_batch_add(pmm_batch_t *batch, void *page) {
+    batch->pages[batch->count++] = page;
+    if (batch->count == PMM_BATCH_SIZE) {
+        pmm_batch_flush(batch);
+    }
+}
 uint64_t pmm_get_used_mem();
 uint64_t pmm_get_free_mem();
 uint64_t pmm_get_total_mem();
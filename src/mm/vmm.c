@@ -393,10 +393,12 @@ void *vmm_fork(void *old) {
     return ret;
 }
 
+/* Nothing can reach a dead address space anymore, so this walks it without vmm_spinlock
+   and hands the frames back to the PMM a batch at a time */
 void vmm_deconstruct_address_space(void *old) {
     pt_t *table = GET_HIGHER_HALF(pt_t *, old);
-    interrupt_state_t state = interrupt_lock();
-    lock(vmm_spinlock);
+    pmm_batch_t batch;
+    batch.count = 0;
     for (uint64_t w = 0; w < 256; w++) {
         /* P4 */
         if (table->table[w] & VMM_PRESENT) {
@@ -412,22 +414,20 @@ void vmm_deconstruct_address_space(void *old) {
                             for (uint64_t x = 0; x < 512; x++) {
                                 /* P1 */
                                 if (table_x->table[x] & VMM_PRESENT) {
-                                    void *phys = (void *) (table_x->table[x] & VMM_4K_PERM_MASK);
-                                    pmm_unalloc(phys, 0x1000);
+                                    pmm_batch_add(&batch, (void *) (table_x->table[x] & VMM_4K_PERM_MASK));
                                 }
                             }
-                            pmm_unalloc(GET_LOWER_HALF(void *, table_x), 0x1000);
+                            pmm_batch_add(&batch, GET_LOWER_HALF(void *, table_x));
                         }
                     }
-                    pmm_unalloc(GET_LOWER_HALF(void *, table_y), 0x1000);
+                    pmm_batch_add(&batch, GET_LOWER_HALF(void *, table_y));
                 }
             }
-            pmm_unalloc(GET_LOWER_HALF(void *, table_z), 0x1000);
+            pmm_batch_add(&batch, GET_LOWER_HALF(void *, table_z));
         }
     }
-    pmm_unalloc(old, 0x1000);
-    unlock(vmm_spinlock);
-    interrupt_unlock(state);
+    pmm_batch_add(&batch, old);
+    pmm_batch_flush(&batch);
 }
 
 int vmm_map(void *phys, void *virt, uint64_t count, uint16_t perms) {
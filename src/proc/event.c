@@ -1,27 +1,57 @@
 #include "event.h"
 #include "proc/scheduler.h"
+#include "proc/wait_queue.h"
 #include "sys/smp.h"
 #include "klibc/lock.h"
-#include "drivers/pit.h"
+#include "sys/timekeeping.h"
+#include "klibc/stdlib.h"
 
 void await_event(event_t *e) {
-    interrupt_safe_lock(sched_lock);
-    thread_t *current_thread = get_cpu_locals()->current_thread;
-    current_thread->event = e;
-    current_thread->state = WAIT_EVENT;
-    force_unlocked_schedule();
+    interrupt_state_t state = interrupt_lock();
+    while (1) {
+        prepare_to_wait(&e->waiters);
+        if (consume_event(e)) {
+            break;
+        }
+        force_unlocked_schedule();
+    }
+    finish_wait(&e->waiters);
+    interrupt_unlock(state);
 }
 
-void await_event_timeout(event_t *e, uint64_t timeout) {
-    interrupt_safe_lock(sched_lock);
-    thread_t *current_thread = get_cpu_locals()->current_thread;
-    current_thread->event = e;
-    current_thread->state = WAIT_EVENT_TIMEOUT;
-    current_thread->event_timeout = timeout;
-    current_thread->event_wait_start = global_ticks;
-    force_unlocked_schedule();
+/* Returns 1 if we timed out instead of getting the event */
+int await_event_timeout(event_t *e, uint64_t timeout_ns) {
+    uint64_t deadline = get_time_ns() + timeout_ns;
+    int timed_out = 0;
+
+    interrupt_state_t state = interrupt_lock();
+    while (1) {
+        prepare_to_wait(&e->waiters);
+        if (consume_event(e)) {
+            break;
+        }
+        if (schedule_timeout(deadline)) {
+            timed_out = !consume_event(e); // Triggered right as the timer went off
+            break;
+        }
+    }
+    finish_wait(&e->waiters);
+    interrupt_unlock(state);
+    return timed_out;
 }
 
 void trigger_event(event_t *e) {
-    atomic_inc((uint32_t *) e);
-}
\ No newline at end of file
+    atomic_inc((uint32_t *) &e->count);
+    wake_one(&e->waiters);
+}
+
+/* Take one trigger from an event, returns 1 if there was one to take */
+int consume_event(event_t *e) {
+    int count = e->count;
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&e->count, &count, count - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,11 +1,17 @@
 #ifndef EVENT_H
 #define EVENT_H
 #include <stdint.h>
+#include "proc/wait_queue.h"
 
-typedef int event_t;
+/* Counting event, each trigger lets one waiter through. Zero it to initialise. */
+typedef struct event {
+    volatile int count;
+    wait_queue_t waiters;
+} event_t;
 
 void await_event(event_t *e);
-void await_event_timeout(event_t *e, uint64_t timeout);
+int await_event_timeout(event_t *e, uint64_t timeout_ns);
 void trigger_event(event_t *e);
+int consume_event(event_t *e);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,5 +1,6 @@
 #include "raw_binary.h"
 #include "klibc/stdlib.h"
+#include "klibc/string.h"
 #include "proc/scheduler.h"
 #include "mm/vmm.h"
 #include "fs/fd.h"
@@ -35,4 +36,11 @@ void launch_binary(char *path) {
     } else {
         sprintf("Got error loading binary: %d\n", fd);
     }
-}
\ No newline at end of file
+}
+
+/* Run position independent code from the kernel image as its own process, loaded at 0 */
+void launch_code(char *name, void *code, uint64_t size) {
+    void *code_buf = kcalloc(size);
+    memcpy(code, code_buf, size);
+    new_binary_process(name, (void *) 0, code_buf, size);
+}
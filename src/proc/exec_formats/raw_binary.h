@@ -1,6 +1,9 @@
 #ifndef RAW_BINARY_EXEC_H
 #define RAW_BINARY_EXEC_H
 
+#include <stdint.h>
+
 void launch_binary(char *path);
+void launch_code(char *name, void *code, uint64_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "fair.h"
+#include "runqueue.h"
+#include "sys/timekeeping.h"
+#include "io/msr.h"
+
+/* Each nice level is ~10% more or less CPU time, same table as Linux */
+static const uint32_t nice_weights[40] = {
+ /* -20 */ 88761, 71755, 56483, 46273, 36291,
+ /* -15 */ 29154, 23254, 18705, 14949, 11916,
+ /* -10 */ 9548, 7620, 6100, 4904, 3906,
+ /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+ /*   0 */ 1024, 820, 655, 526, 423,
+ /*   5 */ 335, 272, 215, 172, 137,
+ /*  10 */ 110, 87, 70, 56, 45,
+ /*  15 */ 36, 29, 23, 18, 15,
+};
+
+uint32_t nice_to_weight(int nice) {
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+    return nice_weights[nice - NICE_MIN];
+}
+
+/* Only call on a thread that isn't queued, since the queue caches total weight */
+int set_thread_nice(thread_t *thread, int nice) {
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+    thread->nice = nice;
+    thread->weight = nice_to_weight(nice);
+    return nice;
+}
+
+void fair_update_vruntime(thread_t *thread, uint64_t tsc_delta) {
+    uint64_t ns = tsc_to_ns(tsc_delta);
+    if (thread->weight != NICE_0_WEIGHT) {
+        ns = (ns * NICE_0_WEIGHT) / thread->weight;
+    }
+    thread->vruntime += ns;
+}
+
+/* Split the latency target between everything on the queue by weight, so slices shrink as the queue grows */
+uint64_t fair_timeslice(thread_t *thread, runqueue_t *rq) {
+    uint64_t nr_running = rq->count - rq->rt.count + 1;
+    uint64_t period = SCHED_LATENCY_NS;
+    if (nr_running > SCHED_LATENCY_NS / SCHED_MIN_GRANULARITY_NS) {
+        period = nr_running * SCHED_MIN_GRANULARITY_NS;
+    }
+
+    uint64_t slice = (period * thread->weight) / (rq->total_weight + thread->weight);
+    if (slice < SCHED_MIN_GRANULARITY_NS) {
+        slice = SCHED_MIN_GRANULARITY_NS;
+    }
+    return slice;
+}
+
+/* New threads start a bit behind everyone else so forking can't be used to hog the CPU */
+void fair_place_new(thread_t *thread, runqueue_t *rq) {
+    uint64_t start = rq->min_vruntime + SCHED_MIN_GRANULARITY_NS;
+    if (vruntime_before(thread->vruntime, start)) {
+        thread->vruntime = start;
+    }
+}
+
+/* Sleepers keep some credit so interactive and IPC threads run soon after waking,
+   but not so much that they can starve the threads that kept running */
+void fair_place_wakeup(thread_t *thread, runqueue_t *rq) {
+    uint64_t floor = rq->min_vruntime - SCHED_WAKEUP_CREDIT_NS;
+    if (vruntime_before(thread->vruntime, floor)) {
+        thread->vruntime = floor;
+    }
+}
+
+/* Should a freshly woken thread kick curr off its CPU, counts the time curr has run so far */
+int fair_wakeup_preempt(thread_t *curr, thread_t *woken) {
+    uint64_t curr_vruntime = curr->vruntime;
+    uint64_t ran = tsc_to_ns(read_tsc() - curr->tsc_started);
+    if (curr->weight != NICE_0_WEIGHT) {
+        ran = (ran * NICE_0_WEIGHT) / curr->weight;
+    }
+    curr_vruntime += ran;
+
+    return vruntime_before(woken->vruntime + SCHED_WAKEUP_GRANULARITY_NS, curr_vruntime);
+}
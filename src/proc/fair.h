@@ -0,0 +1,32 @@
+#ifndef FAIR_H
+#define FAIR_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+
+/* Fair scheduling class, threads are run in order of virtual runtime,
+   which is real runtime scaled by the thread's weight */
+
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+
+#define SCHED_LATENCY_NS 24000000ULL // Time in which every queued thread should run once
+#define SCHED_MIN_GRANULARITY_NS 4000000ULL // Shortest slice, matches the preemption tick
+#define SCHED_WAKEUP_CREDIT_NS (SCHED_LATENCY_NS / 2) // How far behind a waking thread may be placed
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000ULL // How far ahead a woken thread must be to preempt
+
+struct runqueue;
+
+uint32_t nice_to_weight(int nice);
+int set_thread_nice(thread_t *thread, int nice);
+void fair_update_vruntime(thread_t *thread, uint64_t tsc_delta);
+uint64_t fair_timeslice(thread_t *thread, struct runqueue *rq);
+void fair_place_new(thread_t *thread, struct runqueue *rq);
+void fair_place_wakeup(thread_t *thread, struct runqueue *rq);
+int fair_wakeup_preempt(thread_t *curr, thread_t *woken);
+
+static inline int vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t) (a - b) < 0;
+}
+
+#endif
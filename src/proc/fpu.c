@@ -0,0 +1,124 @@
+#include "fpu.h"
+#include "sys/smp.h"
+#include "klibc/string.h"
+#include <cpuid.h>
+
+#define CR0_TS (1 << 3)
+#define CR4_OSXSAVE (1 << 18)
+
+DEFINE_PER_CPU(thread_t *, fpu_owner); // Thread whose state is in this CPU's FPU registers
+DEFINE_PER_CPU(uint8_t, fpu_ts); // Mirrors CR0.TS so switches don't have to read CR0
+
+uint8_t fpu_use_xsave = 0;
+uint8_t fpu_use_xsaveopt = 0;
+uint64_t fpu_xcr0 = XSTATE_X87 | XSTATE_SSE;
+
+static inline void fpu_set_ts() {
+    uint64_t cr0;
+    asm volatile("movq %%cr0, %0;" : "=r"(cr0));
+    asm volatile("movq %0, %%cr0;" :: "r"(cr0 | CR0_TS));
+    *this_cpu_ptr(fpu_ts) = 1;
+}
+
+static inline void fpu_clear_ts() {
+    asm volatile("clts");
+    *this_cpu_ptr(fpu_ts) = 0;
+}
+
+static inline void xsetbv(uint32_t index, uint64_t value) {
+    asm volatile("xsetbv" :: "c"(index), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+/* Turn on XSAVE if we have it and start every CPU with TS set and no owner */
+void fpu_init_cpu() {
+    uint32_t a, b, c, d;
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_XSAVE)) {
+        uint64_t cr4;
+        asm volatile("movq %%cr4, %0;" : "=r"(cr4));
+        asm volatile("movq %0, %%cr4;" :: "r"(cr4 | CR4_OSXSAVE));
+
+        __cpuid_count(0xD, 0, a, b, c, d);
+        uint64_t xcr0 = XSTATE_X87 | XSTATE_SSE | (a & XSTATE_AVX);
+        xsetbv(0, xcr0);
+
+        /* Only keep AVX on if its state fits in the thread's save area */
+        __cpuid_count(0xD, 0, a, b, c, d);
+        if (b > FPU_STATE_SIZE) {
+            xcr0 &= ~(uint64_t) XSTATE_AVX;
+            xsetbv(0, xcr0);
+        }
+
+        __cpuid_count(0xD, 1, a, b, c, d);
+        fpu_use_xsaveopt = a & 1;
+        fpu_use_xsave = 1;
+        fpu_xcr0 = xcr0;
+    }
+
+    *this_cpu_ptr(fpu_owner) = (void *) 0;
+    fpu_set_ts();
+}
+
+/* Everything in its init state. With XSAVE the header says so and only MXCSR is read. */
+void fpu_init_state(thread_t *thread) {
+    memset(thread->fpu_state, 0, FPU_STATE_SIZE);
+    *(uint16_t *) &thread->fpu_state[0] = 0x37F; // FCW
+    *(uint32_t *) &thread->fpu_state[24] = 0x1F80; // MXCSR
+    thread->fpu_cpu = -1;
+}
+
+static void fpu_save(thread_t *thread) {
+    uint32_t lo = (uint32_t) fpu_xcr0;
+    uint32_t hi = (uint32_t) (fpu_xcr0 >> 32);
+    if (fpu_use_xsaveopt) {
+        asm volatile("xsaveopt64 (%0)" :: "r"(thread->fpu_state), "a"(lo), "d"(hi) : "memory"); // Skips what wasn't touched
+    } else if (fpu_use_xsave) {
+        asm volatile("xsave64 (%0)" :: "r"(thread->fpu_state), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxsave64 (%0)" :: "r"(thread->fpu_state) : "memory");
+    }
+}
+
+static void fpu_restore(thread_t *thread) {
+    uint32_t lo = (uint32_t) fpu_xcr0;
+    uint32_t hi = (uint32_t) (fpu_xcr0 >> 32);
+    if (fpu_use_xsave) {
+        asm volatile("xrstor64 (%0)" :: "r"(thread->fpu_state), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxrstor64 (%0)" :: "r"(thread->fpu_state) : "memory");
+    }
+}
+
+/* Write the thread's state back to its save area if it has the FPU on this CPU. The registers
+   keep a valid copy, so it gets them back for free if it's the next to use the FPU here. */
+void fpu_flush(thread_t *thread) {
+    if (!*this_cpu_ptr(fpu_ts) && *this_cpu_ptr(fpu_owner) == thread) {
+        fpu_save(thread);
+    }
+}
+
+void fpu_switch_in(thread_t *thread, int cpu) {
+    if (*this_cpu_ptr(fpu_owner) == thread && thread->fpu_cpu == cpu) {
+        if (*this_cpu_ptr(fpu_ts)) {
+            fpu_clear_ts(); // Nobody loaded anything else since, the registers are still ours
+        }
+    } else if (!*this_cpu_ptr(fpu_ts)) {
+        fpu_set_ts();
+    }
+}
+
+/* #NM handler, load the current thread's state. Returns 0 if there is no thread to give it to. */
+int fpu_device_not_available() {
+    thread_t *thread = get_cpu_locals()->current_thread;
+    if (!thread) {
+        return 0;
+    }
+
+    int cpu = get_cpu_index();
+    fpu_clear_ts();
+    if (*this_cpu_ptr(fpu_owner) != thread || thread->fpu_cpu != cpu) {
+        fpu_restore(thread); // The old owner saved its state when it was switched out
+        *this_cpu_ptr(fpu_owner) = thread;
+        thread->fpu_cpu = cpu;
+    }
+    return 1;
+}
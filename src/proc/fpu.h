@@ -0,0 +1,28 @@
+#ifndef FPU_H
+#define FPU_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+#include "sys/percpu.h"
+
+#define XSTATE_X87 (1 << 0)
+#define XSTATE_SSE (1 << 1)
+#define XSTATE_AVX (1 << 2)
+
+/* FPU state is switched lazily. CR0.TS is set whenever the thread on a CPU doesn't
+   have its state in the registers, and the first FPU instruction it runs traps
+   with #NM so the state can be loaded then. Threads that never touch the FPU,
+   which is every kernel thread, never pay for it. */
+
+DECLARE_PER_CPU(thread_t *, fpu_owner);
+
+extern uint8_t fpu_use_xsave;
+extern uint8_t fpu_use_xsaveopt;
+extern uint64_t fpu_xcr0;
+
+void fpu_init_cpu();
+void fpu_init_state(thread_t *thread);
+void fpu_flush(thread_t *thread);
+void fpu_switch_in(thread_t *thread, int cpu);
+int fpu_device_not_available();
+
+#endif
@@ -0,0 +1,412 @@
+#include "futex.h"
+#include "proc/scheduler.h"
+#include "proc/runqueue.h"
+#include "proc/rt.h"
+#include "sys/smp.h"
+#include "sys/timekeeping.h"
+#include "mm/vmm.h"
+#include "klibc/stdlib.h"
+#include "klibc/errno.h"
+
+static wait_queue_t futex_buckets[FUTEX_HASH_SIZE];
+static pi_state_t *pi_hash[FUTEX_HASH_SIZE]; // Protected by sched_lock, like everything PI
+
+static uint64_t futex_hash(uint64_t key) {
+    key ^= key >> 17; // Futexes are word aligned and often share pages
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key >> (64 - FUTEX_HASH_BITS);
+}
+
+static wait_queue_t *futex_bucket(uint64_t key) {
+    return &futex_buckets[futex_hash(key)];
+}
+
+/* Is this one of the futex buckets */
+int futex_queue(wait_queue_t *wq) {
+    return wq >= futex_buckets && wq < futex_buckets + FUTEX_HASH_SIZE;
+}
+
+/* Block until woken, returns EAGAIN if the futex didn't hold the expected value
+   and ETIMEDOUT if timeout_ns passed first. A timeout of 0 waits forever. */
+int futex_wait(uint32_t *futex, uint32_t expected_value, uint64_t timeout_ns) {
+    uint64_t key = (uint64_t) futex;
+    volatile uint32_t *higher_half_futex = GET_HIGHER_HALF(volatile uint32_t *, futex);
+    wait_queue_t *bucket = futex_bucket(key);
+    int ret = 0;
+
+    uint64_t deadline = timeout_ns ? get_time_ns() + timeout_ns : 0;
+
+    interrupt_state_t state = interrupt_lock();
+    thread_t *thread = get_cpu_locals()->current_thread;
+    thread->futex_key = key;
+    prepare_to_wait(bucket);
+
+    /* We're queued before checking, so a waker that changes the value after this sees us */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (*higher_half_futex != expected_value) {
+        ret = EAGAIN;
+    } else if (deadline) {
+        if (schedule_timeout(deadline)) {
+            ret = ETIMEDOUT;
+        }
+    } else {
+        force_unlocked_schedule();
+    }
+
+    finish_wait(bucket);
+    interrupt_unlock(state);
+    return ret;
+}
+
+/* Wake up to count threads waiting on the futex in the order they started waiting */
+static int futex_wake_locked(wait_queue_t *bucket, uint64_t key, int count) {
+    int woken = 0;
+    thread_t *thread = bucket->head;
+    while (thread && woken < count) {
+        thread_t *next = thread->wq_next;
+        if (thread->futex_key == key) {
+            wait_queue_remove_locked(bucket, thread);
+            woken += try_wake_thread(thread, WAITING); // Fails if it timed out already
+        }
+        thread = next;
+    }
+    return woken;
+}
+
+/* Returns the number of threads woken */
+int futex_wake(uint32_t *futex, int count) {
+    uint64_t key = (uint64_t) futex;
+    wait_queue_t *bucket = futex_bucket(key);
+
+    interrupt_state_t state = interrupt_lock();
+    lock(bucket->lock);
+    int woken = futex_wake_locked(bucket, key, count);
+    unlock(bucket->lock);
+    interrupt_unlock(state);
+    return woken;
+}
+
+/* Wake wake_count waiters of futex and move up to requeue_count more over to target,
+   so a condition variable broadcast doesn't wake everyone just to fight over the mutex.
+   With compare set, fails with EAGAIN unless futex still holds expected_value.
+   The number of threads woken or moved is put in done. */
+int futex_requeue(uint32_t *futex, int wake_count, uint32_t *target, int requeue_count,
+                  int compare, uint32_t expected_value, int *done) {
+    uint64_t key = (uint64_t) futex;
+    uint64_t target_key = (uint64_t) target;
+    wait_queue_t *bucket = futex_bucket(key);
+    wait_queue_t *target_bucket = futex_bucket(target_key);
+    *done = 0;
+
+    interrupt_state_t state = interrupt_lock();
+
+    /* Lock in address order so two requeues in opposite directions can't deadlock */
+    if (bucket == target_bucket) {
+        lock(bucket->lock);
+    } else if (bucket < target_bucket) {
+        lock(bucket->lock);
+        lock(target_bucket->lock);
+    } else {
+        lock(target_bucket->lock);
+        lock(bucket->lock);
+    }
+
+    int ret = 0;
+    if (compare && *GET_HIGHER_HALF(volatile uint32_t *, futex) != expected_value) {
+        ret = EAGAIN;
+    } else {
+        int moved = 0;
+        *done = futex_wake_locked(bucket, key, wake_count);
+
+        thread_t *thread = bucket->head;
+        while (thread && moved < requeue_count) {
+            thread_t *next = thread->wq_next;
+            if (thread->futex_key == key) {
+                wait_queue_remove_locked(bucket, thread);
+                thread->futex_key = target_key;
+                wait_queue_add_locked(target_bucket, thread);
+                moved++;
+            }
+            thread = next;
+        }
+        *done += moved;
+    }
+
+    unlock(bucket->lock);
+    if (bucket != target_bucket) {
+        unlock(target_bucket->lock);
+    }
+    interrupt_unlock(state);
+    return ret;
+}
+
+static pi_state_t *pi_find(uint64_t key) {
+    pi_state_t *pi = pi_hash[futex_hash(key)];
+    while (pi && pi->key != key) {
+        pi = pi->hash_next;
+    }
+    return pi;
+}
+
+static void pi_unlink_owner(pi_state_t *pi) {
+    pi_state_t **link = &pi->owner->pi_owned;
+    while (*link != pi) {
+        link = &(*link)->owner_next;
+    }
+    *link = pi->owner_next;
+    pi->owner_next = (void *) 0;
+}
+
+static void pi_link_owner(pi_state_t *pi, thread_t *owner) {
+    pi->owner = owner;
+    pi->owner_next = owner->pi_owned;
+    owner->pi_owned = pi;
+}
+
+static pi_state_t *pi_alloc(uint64_t key, thread_t *owner) {
+    pi_state_t *pi = kcalloc(sizeof(pi_state_t));
+    pi->key = key;
+    uint64_t hash = futex_hash(key);
+    pi->hash_next = pi_hash[hash];
+    pi_hash[hash] = pi;
+    pi_link_owner(pi, owner);
+    return pi;
+}
+
+static void pi_free(pi_state_t *pi) {
+    pi_state_t **link = &pi_hash[futex_hash(pi->key)];
+    while (*link != pi) {
+        link = &(*link)->hash_next;
+    }
+    *link = pi->hash_next;
+    pi_unlink_owner(pi);
+    kfree(pi);
+}
+
+static void pi_add_waiter(pi_state_t *pi, thread_t *thread) {
+    thread_t **link = &pi->waiters;
+    while (*link) {
+        link = &(*link)->pi_next;
+    }
+    thread->pi_next = (void *) 0;
+    *link = thread;
+    thread->pi_blocked_on = pi;
+}
+
+static void pi_remove_waiter(pi_state_t *pi, thread_t *thread) {
+    thread_t **link = &pi->waiters;
+    while (*link != thread) {
+        link = &(*link)->pi_next;
+    }
+    *link = thread->pi_next;
+    thread->pi_next = (void *) 0;
+    thread->pi_blocked_on = (void *) 0;
+}
+
+static int pi_waiter_prio(thread_t *thread) {
+    return thread_is_rt(thread) ? thread->rt_priority : 0;
+}
+
+/* Highest priority waiter, the one that's waited longest if there's a tie */
+static thread_t *pi_top_waiter(pi_state_t *pi) {
+    thread_t *top = pi->waiters;
+    for (thread_t *waiter = pi->waiters; waiter; waiter = waiter->pi_next) {
+        if (pi_waiter_prio(waiter) > pi_waiter_prio(top)) {
+            top = waiter;
+        }
+    }
+    return top;
+}
+
+/* Work out what a thread should run at from its own policy and everything waiting on
+   the PI futexes it owns, then pass that on to whoever it's blocked on in turn.
+   Only real-time waiters boost, they lend the owner their priority as SCHED_FIFO. */
+static void pi_update_prio(thread_t *thread) {
+    for (int depth = 0; thread && depth < FUTEX_PI_MAX_DEPTH; depth++) {
+        int policy = thread->base_policy;
+        int priority = thread->base_rt_priority;
+        for (pi_state_t *pi = thread->pi_owned; pi; pi = pi->owner_next) {
+            for (thread_t *waiter = pi->waiters; waiter; waiter = waiter->pi_next) {
+                if (pi_waiter_prio(waiter) > priority) {
+                    policy = SCHED_FIFO;
+                    priority = pi_waiter_prio(waiter);
+                }
+            }
+        }
+
+        if (policy != thread->policy || priority != thread->rt_priority) {
+            rq_set_boost(thread, policy, priority);
+        } else if (depth) {
+            break; // Nothing further up the chain changes either
+        }
+        thread = thread->pi_blocked_on ? thread->pi_blocked_on->owner : (void *) 0;
+    }
+}
+
+/* Give a PI futex to its top waiter and wake it, flags go in the futex next to its TID */
+static void pi_handoff(pi_state_t *pi, uint32_t flags) {
+    volatile uint32_t *word = GET_HIGHER_HALF(volatile uint32_t *, pi->key);
+    thread_t *old_owner = pi->owner;
+    thread_t *new_owner = pi_top_waiter(pi);
+    pi_remove_waiter(pi, new_owner);
+
+    uint32_t value = ((uint32_t) new_owner->tid & FUTEX_TID_MASK) | flags;
+    if (pi->waiters) {
+        value |= FUTEX_WAITERS;
+        pi_unlink_owner(pi);
+        pi_link_owner(pi, new_owner);
+    } else {
+        pi_free(pi);
+    }
+    __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+
+    pi_update_prio(old_owner);
+    pi_update_prio(new_owner);
+    try_wake_thread(new_owner, WAITING);
+}
+
+/* Take a PI futex, blocking until it's handed to us if someone holds it. The holder
+   runs at our priority until it unlocks, if that's higher than its own. Returns
+   EDEADLK if we already hold it and ETIMEDOUT if timeout_ns passed first. */
+int futex_lock_pi(uint32_t *futex, uint64_t timeout_ns) {
+    uint64_t key = (uint64_t) futex;
+    volatile uint32_t *word = GET_HIGHER_HALF(volatile uint32_t *, futex);
+    wait_queue_t *bucket = futex_bucket(key);
+    uint64_t deadline = timeout_ns ? get_time_ns() + timeout_ns : 0;
+    int ret = 0;
+
+    interrupt_state_t state = interrupt_lock();
+    thread_t *thread = get_cpu_locals()->current_thread;
+    uint32_t tid = (uint32_t) thread->tid & FUTEX_TID_MASK;
+
+    interrupt_safe_lock(sched_lock);
+    pi_state_t *pi = pi_find(key);
+    thread_t *owner;
+    uint32_t value = *word;
+    while (1) {
+        uint32_t owner_tid = value & FUTEX_TID_MASK;
+        if (owner_tid == tid) {
+            interrupt_safe_unlock(sched_lock);
+            interrupt_unlock(state);
+            return EDEADLK;
+        }
+
+        /* Take it if it's free, or if its owner exited without anyone waiting to get it */
+        owner = owner_tid ? get_thread(owner_tid) : (void *) 0;
+        uint32_t new_value = value | FUTEX_WAITERS;
+        if (!owner) {
+            new_value = tid | (pi ? FUTEX_WAITERS : 0) | (owner_tid ? FUTEX_OWNER_DIED : 0);
+        }
+        if (__atomic_compare_exchange_n(word, &value, new_value, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+    }
+
+    if (!owner) {
+        if (pi) {
+            /* Userspace cleared it under the waiters' feet, they're ours now */
+            thread_t *old_owner = pi->owner;
+            pi_unlink_owner(pi);
+            pi_link_owner(pi, thread);
+            pi_update_prio(old_owner);
+            pi_update_prio(thread);
+        }
+        interrupt_safe_unlock(sched_lock);
+        interrupt_unlock(state);
+        return 0;
+    }
+
+    if (!pi) {
+        pi = pi_alloc(key, owner);
+    } else if (pi->owner != owner) {
+        thread_t *old_owner = pi->owner;
+        pi_unlink_owner(pi);
+        pi_link_owner(pi, owner);
+        pi_update_prio(old_owner);
+    }
+    pi_add_waiter(pi, thread);
+    pi_update_prio(owner);
+    interrupt_safe_unlock(sched_lock);
+
+    /* pi_blocked_on is cleared under sched_lock by whoever hands the futex to us */
+    thread->futex_key = key;
+    int timed_out = 0;
+    while (thread->pi_blocked_on && !timed_out) {
+        prepare_to_wait(bucket);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (thread->pi_blocked_on) {
+            if (deadline) {
+                timed_out = schedule_timeout(deadline);
+            } else {
+                force_unlocked_schedule();
+            }
+        }
+        finish_wait(bucket);
+    }
+
+    if (timed_out) {
+        interrupt_safe_lock(sched_lock);
+        pi = thread->pi_blocked_on;
+        if (pi) { // Might have been handed the futex right as we timed out
+            owner = pi->owner;
+            pi_remove_waiter(pi, thread);
+            if (!pi->waiters) {
+                pi_free(pi); // FUTEX_WAITERS stays set, the owner's unlock clears it
+            }
+            pi_update_prio(owner);
+            ret = ETIMEDOUT;
+        }
+        interrupt_safe_unlock(sched_lock);
+    }
+    interrupt_unlock(state);
+    return ret;
+}
+
+/* Release a PI futex we own, straight to the top waiter if there is one */
+int futex_unlock_pi(uint32_t *futex) {
+    uint64_t key = (uint64_t) futex;
+    volatile uint32_t *word = GET_HIGHER_HALF(volatile uint32_t *, futex);
+    int ret = 0;
+
+    interrupt_state_t state = interrupt_lock();
+    thread_t *thread = get_cpu_locals()->current_thread;
+
+    interrupt_safe_lock(sched_lock);
+    if ((*word & FUTEX_TID_MASK) != ((uint32_t) thread->tid & FUTEX_TID_MASK)) {
+        ret = EPERM;
+    } else {
+        pi_state_t *pi = pi_find(key);
+        if (pi) {
+            pi_handoff(pi, 0);
+        } else {
+            __atomic_store_n(word, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+    interrupt_safe_unlock(sched_lock);
+    interrupt_unlock(state);
+    return ret;
+}
+
+/* Put a thread's boost back on after its policy was set, and pass the change up the
+   chain it's blocked on. Expects sched_lock to be held. */
+void futex_pi_reapply(thread_t *thread) {
+    pi_update_prio(thread);
+}
+
+/* Let go of everything PI a dying thread is part of. Futexes it owns go to their
+   waiters marked FUTEX_OWNER_DIED. Expects sched_lock to be held. */
+void futex_exit_thread(thread_t *thread) {
+    pi_state_t *pi = thread->pi_blocked_on;
+    if (pi) {
+        thread_t *owner = pi->owner;
+        pi_remove_waiter(pi, thread);
+        if (!pi->waiters) {
+            pi_free(pi);
+        }
+        pi_update_prio(owner);
+    }
+
+    while (thread->pi_owned) {
+        pi_handoff(thread->pi_owned, FUTEX_OWNER_DIED);
+    }
+}
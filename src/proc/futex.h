@@ -0,0 +1,46 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+#include <stdint.h>
+#include "proc/wait_queue.h"
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+#define FUTEX_REQUEUE 3
+#define FUTEX_CMP_REQUEUE 4
+#define FUTEX_LOCK_PI 6
+#define FUTEX_UNLOCK_PI 7
+
+/* A PI futex holds the owner's TID, with these bits on top */
+#define FUTEX_WAITERS 0x80000000 // Unlocking has to go through the kernel
+#define FUTEX_OWNER_DIED 0x40000000 // The last owner exited while holding it
+#define FUTEX_TID_MASK 0x3FFFFFFF
+
+#define FUTEX_PI_MAX_DEPTH 8 // How far a boost follows a chain of blocked owners
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+/* Kernel side of a PI futex, only around while something is waiting on it */
+typedef struct pi_state {
+    uint64_t key;
+    thread_t *owner;
+    thread_t *waiters; // Linked through pi_next, in the order they came in
+    struct pi_state *hash_next;
+    struct pi_state *owner_next; // Next in the owner's pi_owned
+} pi_state_t;
+
+/* Futexes are keyed by physical address so processes sharing memory can use them,
+   waiters for every key that hashes to a bucket share its queue */
+int futex_wait(uint32_t *futex, uint32_t expected_value, uint64_t timeout_ns);
+int futex_wake(uint32_t *futex, int count);
+int futex_requeue(uint32_t *futex, int wake_count, uint32_t *target, int requeue_count,
+                  int compare, uint32_t expected_value, int *done);
+
+int futex_queue(wait_queue_t *wq);
+
+int futex_lock_pi(uint32_t *futex, uint64_t timeout_ns);
+int futex_unlock_pi(uint32_t *futex);
+void futex_pi_reapply(thread_t *thread);
+void futex_exit_thread(thread_t *thread);
+
+#endif
@@ -1,16 +1,18 @@
 #include "ipc.h"
 #include "event.h"
+#include "wait_queue.h"
 #include "scheduler.h"
+#include "rt.h"
 #include "sys/smp.h"
 #include "klibc/stdlib.h"
-#include "drivers/pit.h"
+#include "sys/timekeeping.h"
 
 /* IPC server init includes */
 #include "drivers/vesa.h"
 
 int register_ipc_handle(int port) {
     interrupt_safe_lock(sched_lock);
-    process_t *cur_process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *cur_process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
 
     lock(cur_process->ipc_create_handle_lock);
@@ -28,7 +30,7 @@ int register_ipc_handle(int port) {
 
 ipc_handle_t *wait_ipc(int port) {
     interrupt_safe_lock(sched_lock);
-    process_t *cur_process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *cur_process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
 
     ipc_handle_t *handle = hashmap_get_elem(cur_process->ipc_handles, port);
@@ -37,16 +39,47 @@ ipc_handle_t *wait_ipc(int port) {
     }
     handle->listening = 1;
 
-    event_t ipc_await_event = 0;
+    event_t ipc_await_event = {0};
     handle->ipc_event = &ipc_await_event;
     await_event(&ipc_await_event);
     handle->listening = 0;
     return handle;
 }
 
+/* Take the connection lock of a server, sleeping until whoever holds it is done.
+   Returns 1 if we gave up after IPC_CONNECT_TIMEOUT_MS. */
+static int ipc_connect(ipc_handle_t *handle) {
+    if (!spinlock_check_and_lock(&handle->connect_lock.lock_dat)) {
+        return 0; // Wasn't locked
+    }
+
+    uint64_t deadline = get_time_ns() + IPC_CONNECT_TIMEOUT_MS * 1000000ULL;
+    int timed_out = 0;
+
+    interrupt_state_t state = interrupt_lock();
+    while (1) {
+        prepare_to_wait(&handle->connect_waiters);
+        if (!spinlock_check_and_lock(&handle->connect_lock.lock_dat)) {
+            break; // We own the lock now
+        }
+        if (schedule_timeout(deadline)) {
+            timed_out = spinlock_check_and_lock(&handle->connect_lock.lock_dat) != 0;
+            break;
+        }
+    }
+    finish_wait(&handle->connect_waiters);
+    interrupt_unlock(state);
+    return timed_out;
+}
+
+static void ipc_disconnect(ipc_handle_t *handle) {
+    atomic_dec(&handle->connect_lock.lock_dat);
+    wake_one(&handle->connect_waiters);
+}
+
 union ipc_err write_ipc_server(int pid, int port, void *buf, int size) {
     interrupt_safe_lock(sched_lock);
-    process_t *target_process = processes[pid];
+    process_t *target_process = get_process(pid);
     interrupt_safe_unlock(sched_lock);
 
     lock(target_process->ipc_create_handle_lock);
@@ -64,26 +97,15 @@ union ipc_err write_ipc_server(int pid, int port, void *buf, int size) {
         return err; // Server hasn't setup yet
     }
 
-    if (spinlock_check_and_lock(&handle->connect_lock.lock_dat)) { // Was locked
-        uint64_t start_ticks = global_ticks;
-        uint8_t got_lock = 0;
-        while (start_ticks + IPC_CONNECT_TIMEOUT_MS > global_ticks) {
-            if (!spinlock_check_and_lock(&handle->connect_lock.lock_dat)) {
-                got_lock = 1;
-                break; // We own the lock now
-            }
-        }
-
-        if (!got_lock) {
-            union ipc_err err;
-            err.parts.err = IPC_CONNECTION_TIMEOUT;
-            return err;
-        }
+    if (ipc_connect(handle)) {
+        union ipc_err err;
+        err.parts.err = IPC_CONNECTION_TIMEOUT;
+        return err;
     }
 
     // If we made it here, we have the connection lock
 
-    event_t wait_server_done = 0;
+    event_t wait_server_done = {0};
 
     /* Set data, trigger event, wait */
     handle->pid = get_cpu_locals()->current_thread->parent_pid;
@@ -93,7 +115,7 @@ union ipc_err write_ipc_server(int pid, int port, void *buf, int size) {
     handle->operation_type = IPC_OPERATION_WRITE;
     trigger_event(handle->ipc_event);
     await_event(handle->ipc_completed);
-    atomic_dec(&handle->connect_lock.lock_dat);
+    ipc_disconnect(handle);
 
     if (!handle->err) {
         union ipc_err err;
@@ -109,7 +131,7 @@ union ipc_err write_ipc_server(int pid, int port, void *buf, int size) {
 
 union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
     interrupt_safe_lock(sched_lock);
-    process_t *target_process = processes[pid];
+    process_t *target_process = get_process(pid);
     interrupt_safe_unlock(sched_lock);
 
     lock(target_process->ipc_create_handle_lock);
@@ -127,26 +149,15 @@ union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
         return err; // Server hasn't setup yet
     }
 
-    if (spinlock_check_and_lock(&handle->connect_lock.lock_dat)) { // Was locked
-        uint64_t start_ticks = global_ticks;
-        uint8_t got_lock = 0;
-        while (start_ticks + IPC_CONNECT_TIMEOUT_MS > global_ticks) {
-            if (!spinlock_check_and_lock(&handle->connect_lock.lock_dat)) {
-                got_lock = 1;
-                break; // We own the lock now
-            }
-        }
-
-        if (!got_lock) {
-            union ipc_err err;
-            err.parts.err = IPC_CONNECTION_TIMEOUT;
-            return err;
-        }
+    if (ipc_connect(handle)) {
+        union ipc_err err;
+        err.parts.err = IPC_CONNECTION_TIMEOUT;
+        return err;
     }
 
     // If we made it here, we have the connection lock
 
-    event_t wait_server_done = 0;
+    event_t wait_server_done = {0};
 
     /* Set data, trigger event, wait */
     handle->pid = get_cpu_locals()->current_thread->parent_pid;
@@ -156,7 +167,7 @@ union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
     handle->operation_type = IPC_OPERATION_READ;
     trigger_event(handle->ipc_event);
     await_event(handle->ipc_completed);
-    atomic_dec(&handle->connect_lock.lock_dat);
+    ipc_disconnect(handle);
 
     if (!handle->err) {
         union ipc_err err;
@@ -172,6 +183,7 @@ union ipc_err read_ipc_server(int pid, int port, void *buf, int size) {
 
 void setup_ipc_servers() {
     /* VESA IPC server */
-    thread_t *vesa_ipc = create_thread("VESA IPC server", vesa_ipc_server, (uint64_t) kcalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE, 0);
+    thread_t *vesa_ipc = create_kthread("VESA IPC server", vesa_ipc_server);
+    set_thread_policy(vesa_ipc, SCHED_FIFO, RT_PRIO_VESA);
     add_new_child_thread(vesa_ipc, 0);
 }
\ No newline at end of file
@@ -22,6 +22,7 @@ typedef struct {
     int listening; // Is the server listening?
     int err; // error for the server to return
     lock_t connect_lock; // The lock for connecting to the server for an operation
+    wait_queue_t connect_waiters; // Clients waiting for the connect lock
     event_t *ipc_event; // This event is what IPC clients should trigger to signal ready to transfer
     event_t *ipc_completed; // This event will be triggered when the IPC server is done its work
 } ipc_handle_t;
@@ -0,0 +1,125 @@
+#include "rt.h"
+#include "sys/timekeeping.h"
+#include "klibc/errno.h"
+
+/* Only call on a thread that isn't queued, since the queues sort by policy */
+int set_thread_policy(thread_t *thread, int policy, int priority) {
+    if (policy == SCHED_NORMAL) {
+        if (priority != 0) {
+            return EINVAL;
+        }
+    } else if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        if (priority < RT_PRIO_MIN || priority > RT_PRIO_MAX) {
+            return EINVAL;
+        }
+    } else {
+        return EINVAL;
+    }
+
+    thread->base_policy = (uint8_t) policy;
+    thread->base_rt_priority = (uint8_t) priority;
+    set_thread_boost(thread, policy, priority);
+    return 0;
+}
+
+/* Change the policy the thread runs with but not its base one, for priority inheritance.
+   Same rules as set_thread_policy about the thread not being queued. */
+void set_thread_boost(thread_t *thread, int policy, int priority) {
+    thread->policy = (uint8_t) policy;
+    thread->rt_priority = (uint8_t) priority;
+    thread->rt_slice_used = 0;
+}
+
+void rt_enqueue(rt_queue_t *q, thread_t *thread, int head) {
+    int prio = thread->rt_priority;
+    if (head) {
+        thread->rt_prev = (void *) 0;
+        thread->rt_next = q->heads[prio];
+        if (q->heads[prio]) {
+            q->heads[prio]->rt_prev = thread;
+        } else {
+            q->tails[prio] = thread;
+        }
+        q->heads[prio] = thread;
+    } else {
+        thread->rt_next = (void *) 0;
+        thread->rt_prev = q->tails[prio];
+        if (q->tails[prio]) {
+            q->tails[prio]->rt_next = thread;
+        } else {
+            q->heads[prio] = thread;
+        }
+        q->tails[prio] = thread;
+    }
+    q->bitmap[prio / 64] |= (uint64_t) 1 << (prio % 64);
+    q->count++;
+}
+
+void rt_dequeue(rt_queue_t *q, thread_t *thread) {
+    int prio = thread->rt_priority;
+    if (thread->rt_prev) {
+        thread->rt_prev->rt_next = thread->rt_next;
+    } else {
+        q->heads[prio] = thread->rt_next;
+    }
+    if (thread->rt_next) {
+        thread->rt_next->rt_prev = thread->rt_prev;
+    } else {
+        q->tails[prio] = thread->rt_prev;
+    }
+    thread->rt_next = (void *) 0;
+    thread->rt_prev = (void *) 0;
+
+    if (!q->heads[prio]) {
+        q->bitmap[prio / 64] &= ~((uint64_t) 1 << (prio % 64));
+    }
+    q->count--;
+}
+
+/* Highest priority below `below` with something queued, 0 if there's none */
+int rt_highest(rt_queue_t *q, int below) {
+    for (int word = (below - 1) / 64; word >= 0 && below > 0; word--) {
+        uint64_t bits = q->bitmap[word];
+        if (word == (below - 1) / 64 && (below % 64)) {
+            bits &= ((uint64_t) 1 << (below % 64)) - 1;
+        }
+        if (bits) {
+            return word * 64 + 63 - __builtin_clzll(bits);
+        }
+    }
+    return 0;
+}
+
+/* Charge time a real-time thread ran to its CPU's budget, and to its RR slice */
+void rt_account(rt_queue_t *q, thread_t *thread, uint64_t ns) {
+    uint64_t now = get_time_ns();
+    if (now - q->period_start >= RT_PERIOD_NS) {
+        q->period_start = now;
+        q->time_ns = 0;
+    }
+    q->time_ns += ns;
+    thread->rt_slice_used += ns;
+}
+
+/* Has the CPU used up its real-time budget, counting pending_ns the current thread
+   ran that hasn't been accounted yet */
+int rt_throttled(rt_queue_t *q, uint64_t pending_ns) {
+    if (get_time_ns() - q->period_start >= RT_PERIOD_NS) {
+        return 0; // New period, rt_account resets it the next time it runs
+    }
+    return q->time_ns + pending_ns >= RT_RUNTIME_NS;
+}
+
+/* Preempted FIFO threads keep their place at the front, so do RR threads with slice
+   left. Threads that yielded go to the back. */
+int rt_preempted_to_head(thread_t *thread) {
+    if (thread->rt_yielded) {
+        thread->rt_yielded = 0;
+        return 0;
+    }
+    if (thread->policy == SCHED_RR && thread->rt_slice_used >= SCHED_RR_TIMESLICE_NS) {
+        thread->rt_slice_used = 0;
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef RT_H
+#define RT_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+
+/* Real-time scheduling class. Real-time threads always run before normal ones,
+   highest priority first, and a thread keeps the CPU until something of a higher
+   priority shows up (FIFO) or its slice runs out (RR). Each CPU may only spend
+   RT_RUNTIME_NS of every RT_PERIOD_NS on them so a runaway can't lock it up. */
+
+#define SCHED_NORMAL 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+
+#define RT_PRIO_MIN 1
+#define RT_PRIO_MAX 99
+#define RT_PRIO_LEVELS (RT_PRIO_MAX + 1)
+
+#define SCHED_RR_TIMESLICE_NS 20000000ULL
+#define RT_PERIOD_NS 1000000000ULL
+#define RT_RUNTIME_NS 950000000ULL
+
+/* Priorities for the kernel's own servers */
+#define RT_PRIO_VESA 40
+
+/* A FIFO list of threads for every priority, and a bitmap of which ones are non-empty */
+typedef struct {
+    thread_t *heads[RT_PRIO_LEVELS];
+    thread_t *tails[RT_PRIO_LEVELS];
+    uint64_t bitmap[(RT_PRIO_LEVELS + 63) / 64];
+    uint64_t count;
+
+    uint64_t time_ns; // Time spent running real-time threads this period
+    uint64_t period_start;
+} rt_queue_t;
+
+int set_thread_policy(thread_t *thread, int policy, int priority);
+void set_thread_boost(thread_t *thread, int policy, int priority);
+void rt_enqueue(rt_queue_t *q, thread_t *thread, int head);
+void rt_dequeue(rt_queue_t *q, thread_t *thread);
+int rt_highest(rt_queue_t *q, int below);
+void rt_account(rt_queue_t *q, thread_t *thread, uint64_t ns);
+int rt_throttled(rt_queue_t *q, uint64_t pending_ns);
+int rt_preempted_to_head(thread_t *thread);
+
+static inline int thread_is_rt(thread_t *thread) {
+    return thread->policy != SCHED_NORMAL;
+}
+
+#endif
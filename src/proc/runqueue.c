@@ -0,0 +1,656 @@
+#include "runqueue.h"
+#include "fair.h"
+#include "sys/smp.h"
+#include "sys/timekeeping.h"
+#include "io/msr.h"
+#include "sys/ktimer.h"
+#include "sys/lapic_timer.h"
+#include "drivers/pit.h"
+#include "klibc/stdlib.h"
+#include "klibc/errno.h"
+#include "sys/topology.h"
+
+DEFINE_PER_CPU(runqueue_t, runqueue);
+DEFINE_PER_CPU_COUNTER(wakeup_count);
+DEFINE_PER_CPU_COUNTER(wakeup_latency_ns);
+DEFINE_PER_CPU(uint64_t, wakeup_latency_max_ns);
+DEFINE_PER_CPU(ktimer_t, balance_timer);
+
+static int rq_less(rb_node_t *a, rb_node_t *b) {
+    return vruntime_before(rb_entry(a, thread_t, rq_node)->vruntime, rb_entry(b, thread_t, rq_node)->vruntime);
+}
+
+static void rq_link(runqueue_t *rq, thread_t *thread, int head) {
+    if (thread_is_rt(thread)) {
+        rt_enqueue(&rq->rt, thread, head);
+    } else {
+        rb_insert(&rq->tree, &thread->rq_node, rq_less);
+        rq->total_weight += thread->weight;
+    }
+    rq->count++;
+}
+
+static void rq_unlink(runqueue_t *rq, thread_t *thread) {
+    if (thread_is_rt(thread)) {
+        rt_dequeue(&rq->rt, thread);
+    } else {
+        rb_erase(&rq->tree, &thread->rq_node);
+        rq->total_weight -= thread->weight;
+    }
+    thread->rq_cpu = -1;
+    rq->count--;
+}
+
+/* Check if a queued thread can be run right now, expects the run queue lock to be held */
+static int rq_thread_runnable(thread_t *thread) {
+    asm volatile("" ::: "memory");
+    if (thread->running && thread != get_cpu_locals()->current_thread) {
+        return 0; // Still being switched out by another CPU
+    }
+    return thread->state == READY;
+}
+
+/* Did the thread run so recently that its cache footprint is worth keeping */
+static int thread_cache_hot(thread_t *thread) {
+    return tsc_to_ns(read_tsc() - thread->tsc_stopped) < SCHED_MIGRATION_COST_NS;
+}
+
+/* Should a newly queued thread kick curr off its CPU */
+static int rq_wakeup_preempt(runqueue_t *rq, thread_t *curr, thread_t *woken) {
+    if (thread_is_rt(woken)) {
+        return !rt_throttled(&rq->rt, 0) && woken->rt_priority > rq->curr_rt_priority;
+    }
+    if (rq->curr_rt_priority) {
+        return 0; // Normal threads never preempt real-time ones
+    }
+    return fair_wakeup_preempt(curr, woken);
+}
+
+/* Queued threads plus the one running */
+static uint64_t rq_load(int cpu) {
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+    return rq->count + (rq->idle ? 0 : 1);
+}
+
+void rq_enqueue(int cpu, thread_t *thread, int how) {
+    if (!cpumask_test_cpu(&thread->affinity, cpu)) {
+        /* Affinity changed while it was running, move it and keep its lag */
+        int old_cpu = cpu;
+        cpu = rq_select_cpu(thread);
+        thread->vruntime += per_cpu_ptr(runqueue, cpu)->min_vruntime - per_cpu_ptr(runqueue, old_cpu)->min_vruntime;
+    }
+
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+    interrupt_state_t state = interrupt_lock();
+    lock(rq->lock);
+
+    /* Claim the thread so two wakers can't queue it twice */
+    int queued = 0;
+    int was_empty = rq->count == 0;
+    int expected = -1;
+    if (__atomic_compare_exchange_n(&thread->rq_cpu, &expected, cpu, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+        && thread->dying) {
+        thread->rq_cpu = -1; // Killed, it set dying before dequeueing so one of us sees the other
+    } else if (expected == -1) {
+        int head = 0;
+        if (thread_is_rt(thread)) {
+            head = how == RQ_ENQUEUE_PREEMPTED && rt_preempted_to_head(thread);
+        } else if (how == RQ_ENQUEUE_NEW) {
+            fair_place_new(thread, rq);
+        } else if (how == RQ_ENQUEUE_WAKEUP) {
+            fair_place_wakeup(thread, rq);
+        }
+        rq_link(rq, thread, head);
+        queued = 1;
+    }
+
+    unlock(rq->lock);
+
+    if (queued && how != RQ_ENQUEUE_PREEMPTED && scheduler_enabled) {
+        thread_t *curr = rq->curr;
+        if (rq->idle || (curr && rq_wakeup_preempt(rq, curr, thread))) {
+            resched_cpu(cpu); // Run it right away
+        } else if (cpu == get_cpu_index()) {
+            lapic_timer_program_next(); // Make sure the slice end is programmed
+        } else if (was_empty) {
+            kick_cpu(cpu); // Its timer might be off with nothing queued
+        }
+    }
+    interrupt_unlock(state);
+}
+
+/* Take a thread off whatever queue it's on, returns 1 if it was queued */
+int rq_dequeue(thread_t *thread) {
+    int ret = 0;
+    interrupt_state_t state = interrupt_lock();
+    while (1) {
+        int cpu = thread->rq_cpu;
+        if (cpu == -1) {
+            break;
+        }
+
+        runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+        lock(rq->lock);
+        if (thread->rq_cpu == cpu) {
+            rq_unlink(rq, thread);
+            unlock(rq->lock);
+            ret = 1;
+            break;
+        }
+        unlock(rq->lock); // Moved under us, try again
+    }
+    interrupt_unlock(state);
+    return ret;
+}
+
+/* Take the first runnable real-time thread of the highest priority, unless the queue
+   used up its real-time budget. Expects the run queue lock to be held. */
+static thread_t *rq_take_rt(runqueue_t *rq, int target_cpu) {
+    if (!rq->rt.count || rt_throttled(&rq->rt, 0)) {
+        return (void *) 0;
+    }
+    for (int prio = rt_highest(&rq->rt, RT_PRIO_LEVELS); prio; prio = rt_highest(&rq->rt, prio)) {
+        for (thread_t *cur = rq->rt.heads[prio]; cur; cur = cur->rt_next) {
+            if (rq_thread_runnable(cur) && cpumask_test_cpu(&cur->affinity, target_cpu)) {
+                rq_unlink(rq, cur);
+                return cur;
+            }
+        }
+    }
+    return (void *) 0;
+}
+
+/* Take the runnable thread with the least vruntime from a queue, or the one with
+   the most when stealing since it has the longest wait ahead of it anyway.
+   Stealing passes over cache-hot threads unless allow_hot is set.
+   Real-time threads always go first, cache-hot or not. */
+static thread_t *rq_take(int cpu, int target_cpu, int allow_hot) {
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+    int steal = cpu != target_cpu;
+    thread_t *ret;
+
+    lock(rq->lock);
+    ret = rq_take_rt(rq, target_cpu);
+    if (ret) {
+        unlock(rq->lock);
+        return ret;
+    }
+
+    rb_node_t *node = steal ? rb_last(&rq->tree) : rb_first(&rq->tree);
+    while (node) {
+        thread_t *cur = rb_entry(node, thread_t, rq_node);
+        if (rq_thread_runnable(cur) && cpumask_test_cpu(&cur->affinity, target_cpu)
+            && (!steal || allow_hot || !thread_cache_hot(cur))) {
+            rq_unlink(rq, cur);
+            ret = cur;
+            break;
+        }
+        node = steal ? rb_prev(node) : rb_next(node);
+    }
+
+    if (ret) {
+        if (steal) {
+            /* Carry the thread's lag over to the new CPU's virtual clock */
+            ret->vruntime -= rq->min_vruntime;
+        } else if (vruntime_before(rq->min_vruntime, ret->vruntime)) {
+            rq->min_vruntime = ret->vruntime;
+        }
+    }
+    unlock(rq->lock);
+
+    if (ret && steal) {
+        runqueue_t *target_rq = per_cpu_ptr(runqueue, target_cpu);
+        lock(target_rq->lock);
+        ret->vruntime += target_rq->min_vruntime;
+        unlock(target_rq->lock);
+    }
+
+    return ret;
+}
+
+/* Find the CPU in one of cpu's domains with the most queued threads */
+static int rq_find_busiest(int cpu, int level) {
+    cpumask_t *domain = topology_mask(cpu, level);
+    int busiest = -1;
+    uint64_t busiest_count = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (i == cpu || !percpu_offsets[i] || !cpumask_test_cpu(domain, i)) {
+            continue;
+        }
+        runqueue_t *rq = per_cpu_ptr(runqueue, i);
+        if (rq->count > busiest_count) {
+            busiest_count = rq->count;
+            busiest = i;
+        }
+    }
+    return busiest;
+}
+
+/* Pick the next thread for a CPU, stealing if we have nothing. Closer CPUs are tried
+   first, and cache-hot threads are only taken once nothing else is left.
+   Expects interrupts to be off. Returns NULL if the CPU should idle. */
+thread_t *rq_pick_next(int cpu) {
+    thread_t *next = rq_take(cpu, cpu, 0);
+    if (next) {
+        return next;
+    }
+
+    int busiest = -1;
+    for (int level = 0; level < TOPO_LEVELS; level++) {
+        busiest = rq_find_busiest(cpu, level);
+        if (busiest != -1 && (next = rq_take(busiest, cpu, 0))) {
+            return next;
+        }
+    }
+
+    if (busiest != -1) {
+        next = rq_take(busiest, cpu, 1); // Better than idling
+    }
+    return next;
+}
+
+/* Move a thread that isn't cache-hot from one queue to another. Both locks are held
+   so the thread is never off a queue, expects interrupts to be off. */
+static int rq_migrate_one(int src, int dst) {
+    runqueue_t *src_rq = per_cpu_ptr(runqueue, src);
+    runqueue_t *dst_rq = per_cpu_ptr(runqueue, dst);
+    runqueue_t *first = src < dst ? src_rq : dst_rq; // Always lock in CPU order
+    runqueue_t *second = src < dst ? dst_rq : src_rq;
+    int moved = 0;
+
+    lock(first->lock);
+    lock(second->lock);
+    for (rb_node_t *node = rb_last(&src_rq->tree); node; node = rb_prev(node)) {
+        thread_t *cur = rb_entry(node, thread_t, rq_node);
+        if (rq_thread_runnable(cur) && cpumask_test_cpu(&cur->affinity, dst) && !thread_cache_hot(cur)) {
+            rq_unlink(src_rq, cur);
+            cur->vruntime = cur->vruntime - src_rq->min_vruntime + dst_rq->min_vruntime;
+            cur->rq_cpu = dst;
+            rq_link(dst_rq, cur, 0);
+            moved = 1;
+            break;
+        }
+    }
+    unlock(second->lock);
+    unlock(first->lock);
+    return moved;
+}
+
+/* Pull threads over from the busiest CPU, looking in the closest domain first so
+   threads stay near their caches. Across caches only bigger imbalances are fixed. */
+static void rq_balance(int cpu) {
+    uint64_t this_load = rq_load(cpu);
+    for (int level = 0; level < TOPO_LEVELS; level++) {
+        int busiest = rq_find_busiest(cpu, level);
+        if (busiest == -1) {
+            continue;
+        }
+
+        uint64_t busiest_load = rq_load(busiest);
+        uint64_t min_imbalance = level == TOPO_ALL ? SCHED_IMBALANCE_FAR : SCHED_IMBALANCE_NEAR;
+        if (busiest_load < this_load + min_imbalance) {
+            continue;
+        }
+
+        uint64_t to_move = (busiest_load - this_load) / 2;
+        uint64_t moved = 0;
+        while (moved < to_move && rq_migrate_one(busiest, cpu)) {
+            moved++;
+        }
+        if (moved) {
+            return;
+        }
+    }
+}
+
+static void balance_timer_expired(ktimer_t *timer) {
+    int cpu = get_cpu_index();
+    if (per_cpu_ptr(runqueue, cpu)->idle) {
+        return; // Idle CPUs steal in rq_pick_next, the timer restarts once we're busy
+    }
+    rq_balance(cpu);
+    ktimer_start(timer, get_time_ns() + SCHED_BALANCE_INTERVAL_NS);
+}
+
+void rq_init_cpu() {
+    ktimer_init(this_cpu_ptr(balance_timer), balance_timer_expired);
+}
+
+/* Find the CPU with the shortest run queue that the thread may run on */
+int rq_select_cpu(thread_t *thread) {
+    int best = get_cpu_index();
+    uint64_t best_count = ~(uint64_t) 0;
+    if (cpumask_test_cpu(&thread->affinity, best)) {
+        best_count = per_cpu_ptr(runqueue, best)->count;
+    }
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!percpu_offsets[i] || !cpumask_test_cpu(&thread->affinity, i)) {
+            continue;
+        }
+        runqueue_t *rq = per_cpu_ptr(runqueue, i);
+        if (rq->count < best_count) {
+            best_count = rq->count;
+            best = i;
+        }
+    }
+    return best;
+}
+
+/* Called from the scheduler tick, check if the current thread used up its slice */
+int rq_should_preempt(int cpu, thread_t *current) {
+    if (!current || current == get_cpu_locals()->idle_thread) {
+        return 1; // Idle, always look for work
+    }
+    if (current->state != RUNNING || get_cpu_locals()->need_resched) {
+        return 1; // Blocked or killed under us, or someone asked
+    }
+
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+    if (rq->count == 0) {
+        return 0; // Nothing else to run here
+    }
+
+    uint64_t ran = tsc_to_ns(read_tsc() - current->tsc_started);
+    if (thread_is_rt(current)) {
+        if (rt_throttled(&rq->rt, ran)) {
+            return 1; // Out of real-time budget, let normal threads have the rest of the period
+        }
+        int top = rt_highest(&rq->rt, RT_PRIO_LEVELS);
+        if (top > current->rt_priority) {
+            return 1;
+        }
+        return current->policy == SCHED_RR && top == current->rt_priority
+            && current->rt_slice_used + ran >= SCHED_RR_TIMESLICE_NS;
+    }
+    if (rq->rt.count && !rt_throttled(&rq->rt, 0)) {
+        return 1;
+    }
+    return ran >= fair_timeslice(current, rq);
+}
+
+static int rq_any_queued() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (percpu_offsets[i] && per_cpu_ptr(runqueue, i)->count) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* When this CPU next needs to look at its run queue, KTIMER_NONE if it can sleep until kicked */
+uint64_t rq_slice_end(int cpu, thread_t *current) {
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+
+    if (!current || current == get_cpu_locals()->idle_thread) {
+        /* Check back now and then in case there's work to steal */
+        return rq_any_queued() ? get_time_ns() + sched_period * NS_PER_TICK : KTIMER_NONE;
+    }
+    if (rq->count == 0) {
+        return KTIMER_NONE; // Keep running until something gets queued here
+    }
+
+    uint64_t ran = tsc_to_ns(read_tsc() - current->tsc_started);
+    uint64_t now = get_time_ns();
+    uint64_t period_end = rq->rt.period_start + RT_PERIOD_NS;
+    if (thread_is_rt(current)) {
+        /* Run until the budget is gone, or the RR slice if it has to share */
+        uint64_t used = now - rq->rt.period_start >= RT_PERIOD_NS ? ran : rq->rt.time_ns + ran;
+        uint64_t end = used >= RT_RUNTIME_NS ? now : now + (RT_RUNTIME_NS - used);
+        if (current->policy == SCHED_RR) {
+            uint64_t slice_used = current->rt_slice_used + ran;
+            uint64_t slice_end = slice_used >= SCHED_RR_TIMESLICE_NS ? now : now + (SCHED_RR_TIMESLICE_NS - slice_used);
+            if (slice_end < end) {
+                end = slice_end;
+            }
+        }
+        return end;
+    }
+    if (rq->rt.count && !rt_throttled(&rq->rt, 0)) {
+        return now;
+    }
+
+    uint64_t slice = fair_timeslice(current, rq);
+    uint64_t end = ran >= slice ? now : now + (slice - ran);
+    if (rq->rt.count && period_end < end) {
+        end = period_end; // Throttled real-time threads get to run again then
+    }
+    return end;
+}
+
+/* Called by the scheduler whenever a CPU switches threads */
+void rq_set_current(int cpu, thread_t *thread, uint8_t idle) {
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+    rq->curr = idle ? (void *) 0 : thread;
+    rq->curr_rt_priority = !idle && thread_is_rt(thread) ? thread->rt_priority : 0;
+    rq->idle = idle;
+
+    ktimer_t *balance = this_cpu_ptr(balance_timer);
+    if (!idle && balance->cpu == -1) {
+        ktimer_start(balance, get_time_ns() + SCHED_BALANCE_INTERVAL_NS);
+    }
+
+    /* Account how long the thread sat on the queue after being woken */
+    if (thread->wake_tsc) {
+        uint64_t latency = tsc_to_ns(read_tsc() - thread->wake_tsc);
+        thread->wake_tsc = 0;
+
+        this_cpu_ptr(wakeup_count)->count++; // Interrupts are off, no need to guard the increments
+        this_cpu_ptr(wakeup_latency_ns)->count += latency;
+        if (latency > *this_cpu_ptr(wakeup_latency_max_ns)) {
+            *this_cpu_ptr(wakeup_latency_max_ns) = latency;
+        }
+    }
+}
+
+static int rq_cpu_idle(int cpu) {
+    runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+    return rq->idle && rq->count == 0;
+}
+
+/* Account the time a thread ran to its class */
+void rq_account(int cpu, thread_t *thread, uint64_t tsc_delta) {
+    if (thread_is_rt(thread)) {
+        rt_account(&per_cpu_ptr(runqueue, cpu)->rt, thread, tsc_to_ns(tsc_delta));
+    } else {
+        fair_update_vruntime(thread, tsc_delta);
+    }
+}
+
+/* Real-time threads go where they'd push out the least important thread, their
+   last CPU if it's as good as any. -1 if they'd have to wait everywhere. */
+static int rq_select_rt_cpu(thread_t *thread, int last) {
+    int best = -1;
+    int best_prio = thread->rt_priority;
+    if (last != -1 && per_cpu_ptr(runqueue, last)->curr_rt_priority < best_prio) {
+        best = last;
+        best_prio = per_cpu_ptr(runqueue, last)->curr_rt_priority;
+    }
+    for (int i = 0; i < MAX_CPUS && best_prio; i++) {
+        if (percpu_offsets[i] && cpumask_test_cpu(&thread->affinity, i)
+            && per_cpu_ptr(runqueue, i)->curr_rt_priority < best_prio) {
+            best = i;
+            best_prio = per_cpu_ptr(runqueue, i)->curr_rt_priority;
+        }
+    }
+    return best;
+}
+
+/* Where a woken thread should go: the CPU it last ran on if that's idle since its cache
+   is still warm there, then an idle CPU sharing that cache, then its last CPU again if
+   it only just stopped running, then any idle CPU, then back to its last CPU to maybe preempt */
+static int rq_select_wake_cpu(thread_t *thread) {
+    int last = thread->last_cpu;
+    if (last != -1 && !cpumask_test_cpu(&thread->affinity, last)) {
+        last = -1;
+    }
+    if (thread_is_rt(thread)) {
+        int cpu = rq_select_rt_cpu(thread, last);
+        if (cpu != -1) {
+            return cpu;
+        }
+    }
+    if (last != -1) {
+        if (rq_cpu_idle(last)) {
+            return last;
+        }
+        for (int i = 0; i < MAX_CPUS; i++) {
+            if (percpu_offsets[i] && cpus_share_cache(last, i) && cpumask_test_cpu(&thread->affinity, i) && rq_cpu_idle(i)) {
+                return i;
+            }
+        }
+        if (thread_cache_hot(thread)) {
+            return last;
+        }
+    }
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (percpu_offsets[i] && cpumask_test_cpu(&thread->affinity, i) && rq_cpu_idle(i)) {
+            return i;
+        }
+    }
+
+    return last != -1 ? last : rq_select_cpu(thread);
+}
+
+/* Pick the woken thread's CPU and move its vruntime over to that CPU's clock */
+static int rq_wake_cpu(thread_t *thread) {
+    int cpu = rq_select_wake_cpu(thread);
+    int last = thread->last_cpu;
+    if (last != -1 && last != cpu) {
+        thread->vruntime = thread->vruntime - per_cpu_ptr(runqueue, last)->min_vruntime
+            + per_cpu_ptr(runqueue, cpu)->min_vruntime;
+    }
+    return cpu;
+}
+
+/* Queue a thread whose wakeup is still pending, only the first caller gets to. Its
+   vruntime is settled by now, it has been accounted and last_cpu points where it ran. */
+void rq_finish_wake(thread_t *thread) {
+    if (__atomic_exchange_n(&thread->wake_pending, 0, __ATOMIC_ACQ_REL)) {
+        rq_enqueue(rq_wake_cpu(thread), thread, RQ_ENQUEUE_WAKEUP);
+    }
+}
+
+/* A thread still on its CPU is about to have its vruntime bumped by switch_out, so
+   leave it to finish_switch to queue it once it's off */
+static void rq_wake(thread_t *thread) {
+    thread->wake_pending = 1;
+    asm volatile("mfence" ::: "memory"); // Pairs with finish_switch clearing running
+    if (!thread->running) {
+        rq_finish_wake(thread);
+    }
+}
+
+/* Make a thread ready and queue it */
+void wake_thread(thread_t *thread) {
+    thread->wake_tsc = read_tsc();
+    thread->ready_tsc = thread->wake_tsc;
+    thread->state = READY;
+    rq_wake(thread);
+}
+
+/* Wake a thread only if it's still in the state we expect, so racing wakers (a timeout
+   and a real wakeup say) can't both queue it. Returns 1 if we woke it. */
+int try_wake_thread(thread_t *thread, uint8_t expected) {
+    if (!__atomic_compare_exchange_n(&thread->state, &expected, READY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    thread->wake_tsc = read_tsc();
+    thread->ready_tsc = thread->wake_tsc;
+    rq_wake(thread);
+    return 1;
+}
+
+/* Change where a thread may run. A queued thread is moved right away, a running one
+   is kicked off its CPU and moved by rq_enqueue when it's preempted. */
+int rq_set_affinity(thread_t *thread, cpumask_t *mask) {
+    cpumask_t new_mask = *mask;
+    if (!cpumask_and_online(&new_mask)) {
+        return EINVAL;
+    }
+
+    interrupt_state_t state = interrupt_lock();
+    thread->affinity = new_mask;
+    asm volatile("mfence" ::: "memory");
+
+    int cpu = thread->rq_cpu;
+    if (cpu != -1 && !cpumask_test_cpu(&new_mask, cpu)) {
+        runqueue_t *rq = per_cpu_ptr(runqueue, cpu);
+        int moved = 0;
+        lock(rq->lock);
+        if (thread->rq_cpu == cpu) {
+            rq_unlink(rq, thread);
+            moved = 1;
+        }
+        unlock(rq->lock);
+        if (moved) {
+            rq_enqueue(cpu, thread, RQ_ENQUEUE_PREEMPTED);
+        }
+    }
+
+    cpu = thread->cpu;
+    if (cpu != -1 && !cpumask_test_cpu(&new_mask, cpu)) {
+        resched_cpu(cpu);
+    }
+    interrupt_unlock(state);
+    return 0;
+}
+
+/* Change a thread's scheduling class, or only the one it runs with if boost is set.
+   It's taken off its queue while it changes and put back at the end of the new one. */
+static int rq_change_policy(thread_t *thread, int policy, int priority, int boost) {
+    interrupt_state_t state = interrupt_lock();
+    int old_cpu = thread->rq_cpu;
+    int queued = rq_dequeue(thread);
+
+    int was_rt = thread_is_rt(thread);
+    int ret = 0;
+    if (boost) {
+        set_thread_boost(thread, policy, priority);
+    } else {
+        ret = set_thread_policy(thread, policy, priority);
+    }
+
+    /* The CPU whose clock its vruntime should be on: where it's queued next, where it's
+       running, or where it last ran since waking rebases it from there */
+    int cpu = queued ? rq_select_wake_cpu(thread) : thread->cpu;
+    if (cpu == -1) {
+        cpu = thread->last_cpu != -1 ? thread->last_cpu : get_cpu_index();
+    }
+    if (!ret && was_rt && !thread_is_rt(thread)) {
+        thread->vruntime = per_cpu_ptr(runqueue, cpu)->min_vruntime; // Hasn't been kept up while it was real-time
+    } else if (queued && old_cpu != -1 && old_cpu != cpu) {
+        thread->vruntime = thread->vruntime - per_cpu_ptr(runqueue, old_cpu)->min_vruntime
+            + per_cpu_ptr(runqueue, cpu)->min_vruntime;
+    }
+    if (queued) {
+        rq_enqueue(cpu, thread, RQ_ENQUEUE_WAKEUP); // Preempts if it should
+    }
+
+    int running_cpu = thread->cpu;
+    if (!ret && running_cpu != -1) {
+        resched_cpu(running_cpu); // Running, let its CPU look at it again
+    }
+    interrupt_unlock(state);
+    return ret;
+}
+
+int rq_set_scheduler(thread_t *thread, int policy, int priority) {
+    return rq_change_policy(thread, policy, priority, 0);
+}
+
+/* Run a thread with another policy for a while, without touching the one it was set to */
+void rq_set_boost(thread_t *thread, int policy, int priority) {
+    rq_change_policy(thread, policy, priority, 1);
+}
+
+void get_wakeup_stats(wakeup_stats_t *out) {
+    out->wakeups = percpu_counter_sum(wakeup_count);
+    out->total_latency_ns = percpu_counter_sum(wakeup_latency_ns);
+    out->max_latency_ns = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (percpu_offsets[i] && *per_cpu_ptr(wakeup_latency_max_ns, i) > out->max_latency_ns) {
+            out->max_latency_ns = *per_cpu_ptr(wakeup_latency_max_ns, i);
+        }
+    }
+}
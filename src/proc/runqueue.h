@@ -0,0 +1,64 @@
+#ifndef RUNQUEUE_H
+#define RUNQUEUE_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+#include "sys/percpu.h"
+#include "sys/cpumask.h"
+#include "klibc/lock.h"
+#include "klibc/rbtree.h"
+#include "proc/rt.h"
+
+/* Per-CPU queue of threads that want to run, sorted by virtual runtime. The lock is
+   only ever taken with interrupts off, since the scheduler takes it from interrupt context. */
+typedef struct runqueue {
+    lock_t lock;
+    rb_root_t tree; // Normal threads
+    rt_queue_t rt; // Real-time threads, they go first
+    uint64_t count; // Threads queued in both classes
+    uint64_t total_weight; // Sum of the weights of the queued normal threads
+    uint64_t min_vruntime; // Only ever moves forward
+
+    thread_t *curr; // What the CPU is running, only a hint for other CPUs
+    volatile uint8_t curr_rt_priority; // Real-time priority of curr, 0 if it's normal or idle
+    volatile uint8_t idle;
+} runqueue_t;
+
+#define SCHED_MIGRATION_COST_NS 500000ULL // Threads that ran this recently are cache-hot
+#define SCHED_BALANCE_INTERVAL_NS 8000000ULL // How often busy CPUs look for work to pull
+#define SCHED_IMBALANCE_NEAR 2 // Load difference worth fixing between CPUs that share a cache
+#define SCHED_IMBALANCE_FAR 3 // And between ones that don't
+
+/* How a thread is being queued, decides where it's placed in virtual time */
+#define RQ_ENQUEUE_PREEMPTED 0
+#define RQ_ENQUEUE_NEW 1
+#define RQ_ENQUEUE_WAKEUP 2
+
+typedef struct {
+    uint64_t wakeups;
+    uint64_t total_latency_ns; // From being woken to running
+    uint64_t max_latency_ns;
+} wakeup_stats_t;
+
+DECLARE_PER_CPU(runqueue_t, runqueue);
+DECLARE_PER_CPU_COUNTER(wakeup_count);
+DECLARE_PER_CPU_COUNTER(wakeup_latency_ns);
+DECLARE_PER_CPU(uint64_t, wakeup_latency_max_ns);
+
+void rq_init_cpu();
+void rq_enqueue(int cpu, thread_t *thread, int how);
+int rq_dequeue(thread_t *thread);
+thread_t *rq_pick_next(int cpu);
+int rq_select_cpu(thread_t *thread);
+int rq_should_preempt(int cpu, thread_t *current);
+uint64_t rq_slice_end(int cpu, thread_t *current);
+void rq_set_current(int cpu, thread_t *thread, uint8_t idle);
+void wake_thread(thread_t *thread);
+int try_wake_thread(thread_t *thread, uint8_t expected);
+void rq_finish_wake(thread_t *thread);
+int rq_set_affinity(thread_t *thread, cpumask_t *mask);
+int rq_set_scheduler(thread_t *thread, int policy, int priority);
+void rq_set_boost(thread_t *thread, int policy, int priority);
+void rq_account(int cpu, thread_t *thread, uint64_t tsc_delta);
+void get_wakeup_stats(wakeup_stats_t *out);
+
+#endif
@@ -0,0 +1,138 @@
+#include "sched_stats.h"
+#include "proc/scheduler.h"
+#include "proc/futex.h"
+#include "sys/timekeeping.h"
+#include "io/msr.h"
+#include "sys/smp.h"
+#include "klibc/errno.h"
+
+/* Both of these run on the thread's CPU with interrupts off, so there's only ever
+   one writer and the counters don't need to be atomic */
+
+/* Called once tsc_stopped is set, before a preempted thread gets requeued */
+void sched_stats_switch_out(thread_t *thread) {
+    thread_stats_t *stats = &thread->stats;
+    thread->stime_tsc += thread->tsc_stopped - thread->cputime_tsc; // It's in the scheduler
+    sched_hist_add(&stats->run_time, tsc_to_ns(thread->tsc_stopped - thread->tsc_started));
+
+    uint8_t state = thread->state;
+    if (state == RUNNING && !thread->yielding) {
+        stats->involuntary_switches++;
+    } else {
+        stats->voluntary_switches++;
+    }
+    thread->yielding = 0;
+
+    if (state == RUNNING) {
+        thread->ready_tsc = thread->tsc_stopped;
+    } else if (state == SLEEP) {
+        thread->block_kind = BLOCK_SLEEP;
+    } else if (state == WAITING) {
+        thread->block_kind = futex_queue(thread->wait_queue) ? BLOCK_FUTEX : BLOCK_EVENT;
+    }
+}
+
+/* Called when a thread gets the CPU, before rq_set_current clears wake_tsc */
+void sched_stats_switch_in(thread_t *thread, int cpu) {
+    thread_stats_t *stats = &thread->stats;
+    if (thread->ready_tsc) {
+        sched_hist_add(&stats->runq_delay, tsc_to_ns(read_tsc() - thread->ready_tsc));
+        thread->ready_tsc = 0;
+    }
+
+    /* Woken before it even got off the CPU if wake_tsc is older, nothing to count */
+    if (thread->block_kind && thread->wake_tsc > thread->tsc_stopped) {
+        uint64_t ns = tsc_to_ns(thread->wake_tsc - thread->tsc_stopped);
+        if (thread->block_kind == BLOCK_SLEEP) {
+            sched_hist_add(&stats->sleep, ns);
+        } else if (thread->block_kind == BLOCK_FUTEX) {
+            sched_hist_add(&stats->futex_wait, ns);
+        } else {
+            sched_hist_add(&stats->event_wait, ns);
+        }
+    }
+    thread->block_kind = BLOCK_NONE;
+
+    if (thread->last_cpu != -1 && thread->last_cpu != cpu) {
+        stats->migrations++;
+    }
+}
+
+/* User and system time are split at the syscall and interrupt boundaries. Whatever ran
+   since cputime_tsc was in userspace when we come in, and in the kernel when we leave.
+   switch_out charges the rest to the kernel, since that's where a thread leaves from. */
+void account_kernel_entry() {
+    interrupt_state_t state = interrupt_lock();
+    thread_t *thread = get_cpu_locals()->current_thread;
+    if (thread) {
+        uint64_t now = read_tsc();
+        thread->utime_tsc += now - thread->cputime_tsc;
+        thread->cputime_tsc = now;
+    }
+    interrupt_unlock(state);
+}
+
+void account_kernel_exit() {
+    interrupt_state_t state = interrupt_lock();
+    thread_t *thread = get_cpu_locals()->current_thread;
+    if (thread) {
+        uint64_t now = read_tsc();
+        thread->stime_tsc += now - thread->cputime_tsc;
+        thread->cputime_tsc = now;
+    }
+    interrupt_unlock(state);
+}
+
+static void tsc_to_timespec(uint64_t tsc, struct timespec *out) {
+    uint64_t ns = tsc_to_ns(tsc);
+    out->seconds = ns / 1000000000;
+    out->nanoseconds = ns % 1000000000;
+}
+
+static void rusage_add_thread(thread_t *thread, uint64_t *utime, uint64_t *stime, rusage_t *out) {
+    *utime += thread->utime_tsc;
+    *stime += thread->stime_tsc;
+    out->voluntary_switches += thread->stats.voluntary_switches;
+    out->involuntary_switches += thread->stats.involuntary_switches;
+}
+
+/* Other running threads are only counted up to their last transition */
+int get_rusage(int who, rusage_t *out) {
+    thread_t *current = get_cpu_locals()->current_thread;
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    out->voluntary_switches = 0;
+    out->involuntary_switches = 0;
+
+    if (who == RUSAGE_SELF) {
+        interrupt_safe_lock(sched_lock);
+        process_t *process = get_process(current->parent_pid);
+        if (process) {
+            utime = process->dead_utime_tsc;
+            stime = process->dead_stime_tsc;
+            out->voluntary_switches = process->dead_voluntary_switches;
+            out->involuntary_switches = process->dead_involuntary_switches;
+            for (uint64_t i = 0; i < process->threads_size; i++) {
+                int64_t tid = process->threads[i];
+                thread_t *thread = tid ? get_thread(tid) : (void *) 0;
+                if (thread) {
+                    rusage_add_thread(thread, &utime, &stime, out);
+                }
+            }
+        }
+        interrupt_safe_unlock(sched_lock);
+    } else if (who == RUSAGE_THREAD) {
+        rusage_add_thread(current, &utime, &stime, out);
+    } else if (who != RUSAGE_CHILDREN) {
+        return EINVAL;
+    }
+
+    if (who != RUSAGE_CHILDREN) {
+        interrupt_state_t state = interrupt_lock();
+        stime += read_tsc() - current->cputime_tsc; // Our own syscall so far
+        interrupt_unlock(state);
+    }
+    tsc_to_timespec(utime, &out->utime);
+    tsc_to_timespec(stime, &out->stime);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SCHED_STATS_H
+#define SCHED_STATS_H
+#include <stdint.h>
+#include "proc/sleep_queue.h"
+
+/* Per-thread scheduling statistics. Durations are kept as log2 histograms in ns,
+   bucket i counts everything in [2^i, 2^(i+1)) and the last one everything past it. */
+#define SCHED_HIST_BUCKETS 32
+
+/* What a thread was blocked on when it went off the CPU */
+#define BLOCK_NONE 0
+#define BLOCK_EVENT 1 // Any wait queue that isn't a futex's
+#define BLOCK_FUTEX 2
+#define BLOCK_SLEEP 3
+
+typedef struct {
+    uint32_t buckets[SCHED_HIST_BUCKETS];
+} sched_hist_t;
+
+typedef struct {
+    uint64_t voluntary_switches; // Blocked or yielded
+    uint64_t involuntary_switches; // Preempted
+    uint64_t migrations; // Started running on a different CPU than last time
+    sched_hist_t run_time; // How long it kept the CPU each time it got it
+    sched_hist_t runq_delay; // From being made ready (woken or preempted) to running
+    sched_hist_t event_wait; // From blocking until woken, for each BLOCK_ kind
+    sched_hist_t futex_wait;
+    sched_hist_t sleep;
+} thread_stats_t;
+
+static inline void sched_hist_add(sched_hist_t *hist, uint64_t ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= SCHED_HIST_BUCKETS) {
+        bucket = SCHED_HIST_BUCKETS - 1;
+    }
+    hist->buckets[bucket]++;
+}
+
+/* getrusage who values */
+#define RUSAGE_SELF 0 // Every thread of the calling process, dead ones included
+#define RUSAGE_CHILDREN -1 // Nothing waits on children yet, so this is always zero
+#define RUSAGE_THREAD 1
+
+typedef struct {
+    struct timespec utime; // Time spent in userspace
+    struct timespec stime; // Time spent in the kernel on its behalf
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+} rusage_t;
+
+struct thread;
+
+void sched_stats_switch_out(struct thread *thread);
+void sched_stats_switch_in(struct thread *thread, int cpu);
+void account_kernel_entry();
+void account_kernel_exit();
+int get_rusage(int who, rusage_t *out);
+
+#endif
@@ -1,6 +1,5 @@
 #include "scheduler.h"
-#include "mxcsr.h"
-#include "x87_control.h"
+#include "fpu.h"
 #include "safe_userspace.h"
 #include "klibc/stdlib.h"
 #include "klibc/string.h"
@@ -16,21 +15,24 @@
 #include <stddef.h>
 
 #include "drivers/pit.h"
+#include "sys/timekeeping.h"
 #include "urm.h"
+#include "thread_cache.h"
+#include "exec_formats/elf.h"
+#include "runqueue.h"
+#include "fair.h"
+#include "rt.h"
+#include "wait_queue.h"
+#include "sys/lapic_timer.h"
 
 extern char syscall_stub[];
 
-uint64_t threads_list_size = 0;
-uint64_t process_list_size = 0;
-thread_t **threads;
-process_t **processes;
+_Static_assert(offsetof(task_regs_t, r15) == 112 && offsetof(task_regs_t, rsp) == 120 && offsetof(task_regs_t, rip) == 128
+    && offsetof(task_regs_t, ss) == 136 && offsetof(task_regs_t, cs) == 144 && offsetof(task_regs_t, rflags) == 160,
+    "switch.asm depends on the task_regs_t layout");
 
-typedef struct {
-    thread_t **waiting;
-    uint32_t count;
-} futex_wait_list_t;
-hashmap_t *futex_waiters = (void *) 0; // a hashmap of futex address -> thread **
-lock_t futex_lock = {0, 0, 0, 0};
+idr_t thread_ids = {0};
+idr_t process_ids = {0};
 
 uint64_t process_count = 0;
 
@@ -38,14 +40,10 @@ uint8_t scheduler_enabled = 0;
 lock_t scheduler_lock = {0, 0, 0, 0};
 interrupt_safe_lock_t sched_lock = {0, 0, 0, 0, -1};
 
-task_regs_t default_kernel_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x10,0x8,0,0x202,0,0x1F80,0x33f};
-task_regs_t default_user_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x23,0x1B,0,0x202,0,0x1F80,0x33f};
+DEFINE_PER_CPU_COUNTER(sched_irq_count); // Scheduler interrupts taken, for sched_synchronize
 
-int scheduler_ran = 0;
-
-uint64_t get_thread_list_size() {
-    return threads_list_size;
-}
+task_regs_t default_kernel_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x10,0x8,0,0x202,0};
+task_regs_t default_user_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x1B,0x23,0,0x202,0};
 
 void lock_scheduler() {
     interrupt_safe_lock(sched_lock);
@@ -55,37 +53,22 @@ void unlock_scheduler() {
     interrupt_safe_unlock(sched_lock);
 }
 
-void send_scheduler_ipis() {
-    madt_ent0_t **cpus = (madt_ent0_t **) vector_items(&cpu_vector);
-    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
-        if (i < cpu_vector.items_count) {
-            if ((cpus[i]->cpu_flags & 1 || cpus[i]->cpu_flags & 2) && cpus[i]->apic_id != get_lapic_id()) {
-                send_ipi(cpus[i]->apic_id, (1 << 14) | 253); // Send interrupt 253
-                while (!scheduler_ran) { asm("pause"); }
-                scheduler_ran = 0;
-            }
-        }
-    }
-}
-
 void _idle() {
     while (1) {
         asm volatile("hlt");
     }
 }
 
-char default_sse_state[512] __attribute__((aligned(16)));
-
 /* Initialize the BSP for scheduling */
 void scheduler_init_bsp() {
     /* Setup syscall MSRs for this CPU */
     write_msr(0xC0000081, read_msr(0xC0000081) | ((uint64_t) 0x8 << 32));
-    write_msr(0xC0000081, read_msr(0xC0000081) | ((uint64_t) 0x18 << 48));
+    write_msr(0xC0000081, read_msr(0xC0000081) | ((uint64_t) 0x10 << 48)); // sysret takes SS from +8 and CS from +16
     write_msr(0xC0000082, (uint64_t) syscall_stub); // Start execution at the syscall stub when a syscall occurs
-    write_msr(0xC0000084, 0); // Mask nothing
+    write_msr(0xC0000084, 0x600); // Mask IF and DF, syscall_stub turns interrupts on once it's on the kernel stack
     write_msr(0xC0000080, read_msr(0xC0000080) | 1); // Set the syscall enable bit
 
-    asm volatile("fxsave %0;"::"m"(default_sse_state));
+    rq_init_cpu();
 
     /* Setup the idle thread */
     uint64_t idle_rsp = (uint64_t) kcalloc(0x1000) + 0x1000;
@@ -94,6 +77,7 @@ void scheduler_init_bsp() {
     int64_t idle_tid = start_thread(new_idle);
 
     get_cpu_locals()->idle_tid = idle_tid;
+    get_cpu_locals()->idle_thread = new_idle;
     sprintf("Idle task: %ld\n", get_cpu_locals()->idle_tid);
     get_cpu_locals()->idle_start_tsc = read_tsc();
     get_cpu_locals()->currently_idle = 1;
@@ -104,11 +88,13 @@ void scheduler_init_bsp() {
 void scheduler_init_ap() {
     /* Setup syscall MSRs for this CPU */
     write_msr(0xC0000081, read_msr(0xC0000081) | ((uint64_t) 0x8 << 32));
-    write_msr(0xC0000081, read_msr(0xC0000081) | ((uint64_t) 0x18 << 48));
+    write_msr(0xC0000081, read_msr(0xC0000081) | ((uint64_t) 0x10 << 48)); // sysret takes SS from +8 and CS from +16
     write_msr(0xC0000082, (uint64_t) syscall_stub); // Start execution at the syscall stub when a syscall occurs
-    write_msr(0xC0000084, 0);
+    write_msr(0xC0000084, 0x600);
     write_msr(0xC0000080, read_msr(0xC0000080) | 1); // Set the syscall enable bit
 
+    rq_init_cpu();
+
     /* Setup the idle thread */
     uint64_t idle_rsp = (uint64_t) kcalloc(0x1000) + 0x1000;
     thread_t *new_idle = create_thread("Idle thread", _idle, idle_rsp, 0);
@@ -116,37 +102,46 @@ void scheduler_init_ap() {
     int64_t idle_tid = start_thread(new_idle);
 
     get_cpu_locals()->idle_tid = idle_tid;
+    get_cpu_locals()->idle_thread = new_idle;
     sprintf("Idle task: %ld\n", get_cpu_locals()->idle_tid);
     get_cpu_locals()->idle_start_tsc = read_tsc();
     get_cpu_locals()->currently_idle = 1;
     get_cpu_locals()->total_tsc = read_tsc();
 }
 
-/* Create a new thread *and* add it to the dynarray */
+/* Create a new thread *and* give it a TID */
 int64_t new_thread(char *name, void (*main)(), uint64_t rsp, int64_t pid, uint8_t ring) {
     thread_t *new_task = create_thread(name, main, rsp, ring);
     int64_t new_tid = add_new_child_thread(new_task, pid);
     return new_tid;
 }
 
-/* Add the thread to the dynarray */
+/* Make a ring 0 thread with a stack of its own, which goes back to the cache with it */
+thread_t *create_kthread(char *name, void (*main)()) {
+    uint64_t rsp = alloc_kernel_stack();
+    thread_t *thread = create_thread(name, main, rsp, 0);
+    thread->kthread_stack = rsp;
+    return thread;
+}
+
+/* Make a kernel thread that only ever runs on one CPU, start it with add_new_child_thread(thread, 0) */
+thread_t *create_bound_kthread(char *name, void (*main)(), int cpu) {
+    thread_t *thread = create_kthread(name, main);
+    cpumask_clear(&thread->affinity);
+    cpumask_set_cpu(&thread->affinity, cpu);
+    thread->bound = 1;
+    return thread;
+}
+
+/* Give the thread a TID and queue it */
 int64_t start_thread(thread_t *thread) {
     interrupt_safe_lock(sched_lock);
-    int64_t tid = -1;
-    for (uint64_t i = 0; i < threads_list_size; i++) {
-        if (!threads[i]) {
-            tid = i;
-            break;
-        }
-    }
-    if (tid == -1) {
-        threads = krealloc(threads, (threads_list_size + 10) * sizeof(thread_t *));
-        tid = threads_list_size;
-        threads_list_size += 10;
-    }
+    int64_t tid = idr_alloc(&thread_ids, thread);
     thread->tid = tid;
 
-    threads[tid] = thread;
+    if (thread->state == READY) {
+        rq_enqueue(rq_select_cpu(thread), thread, RQ_ENQUEUE_NEW);
+    }
 
     interrupt_safe_unlock(sched_lock);
     return tid;
@@ -155,8 +150,8 @@ int64_t start_thread(thread_t *thread) {
 /* Allocate data for a new thread data block and return it */
 thread_t *create_thread(char *name, void (*main)(), uint64_t rsp, uint8_t ring) {
     /* Allocate new task and it's kernel stack */
-    thread_t *new_task = kcalloc(sizeof(thread_t));
-    new_task->kernel_stack = (uint64_t) kcalloc(0x1000) + 0x1000;
+    thread_t *new_task = alloc_thread_struct();
+    new_task->kernel_stack = alloc_kernel_stack();
 
     /* Setup ring */
     if (ring == 3) {
@@ -169,10 +164,16 @@ thread_t *create_thread(char *name, void (*main)(), uint64_t rsp, uint8_t ring)
     new_task->regs.rsp = rsp;
     new_task->ring = ring;
     new_task->regs.cr3 = base_kernel_cr3;
-    new_task->sleep_node = kcalloc(sizeof(sleep_queue_t));
+    ktimer_init(&new_task->sleep_timer, sleep_timer_expired);
+    ktimer_init(&new_task->timeout_timer, timeout_timer_expired);
     new_task->state = READY;
+    new_task->cpu = -1;
+    new_task->last_cpu = -1;
+    new_task->rq_cpu = -1;
+    cpumask_setall(&new_task->affinity);
+    set_thread_nice(new_task, 0);
     strcpy(name, new_task->name);
-    memcpy((uint8_t *) default_sse_state, (uint8_t *) new_task->sse_region, 512);
+    fpu_init_state(new_task);
 
     /* Create null argv, enviroment, and auxv */
     new_task->vars.envc = 0;
@@ -185,6 +186,15 @@ thread_t *create_thread(char *name, void (*main)(), uint64_t rsp, uint8_t ring)
     return new_task;
 }
 
+/* Give back everything create_thread allocated, for threads that are dead or never started */
+void destroy_thread(thread_t *thread) {
+    free_kernel_stack(thread->kernel_stack);
+    if (thread->kthread_stack) {
+        free_kernel_stack(thread->kthread_stack);
+    }
+    free_thread_struct(thread);
+}
+
 /* Expects something in higher half */
 void add_argv(main_thread_vars_t *vars, char *string) {
     vars->argv = krealloc(vars->argv, (vars->argc + 1) * sizeof(char *));
@@ -218,27 +228,12 @@ int64_t add_new_child_thread_no_stack_init(thread_t *thread, int64_t pid) {
     int64_t index = -1;
 
     /* Find the parent process */
-    process_t *new_parent = (void *) 0;
-    if ((uint64_t) pid < process_list_size) {
-        new_parent = processes[pid];
-    }
-    if (!new_parent) { sprintf("[Scheduler] Couldn't find parent\n"); return -1; }
+    process_t *new_parent = get_process(pid);
+    if (!new_parent) { sprintf("[Scheduler] Couldn't find parent\n"); interrupt_safe_unlock(sched_lock); return -1; }
 
     /* Store the new task and save its TID */
 
-    int64_t new_tid = -1;
-    for (uint64_t i = 0; i < threads_list_size; i++) {
-        if (!threads[i]) {
-            new_tid = i;
-            break;
-        }
-    }
-    if (new_tid == -1) {
-        threads = krealloc(threads, (threads_list_size + 10) * sizeof(thread_t *));
-        new_tid = threads_list_size;
-        threads_list_size += 10;
-    }
-    threads[new_tid] = thread;
+    int64_t new_tid = idr_alloc(&thread_ids, thread);
 
     thread->tid = new_tid;
     thread->regs.cr3 = new_parent->cr3; // Inherit parent's cr3
@@ -251,45 +246,34 @@ int64_t add_new_child_thread_no_stack_init(thread_t *thread, int64_t pid) {
             break;
         }
     }
-    if (new_tid == -1) {
-        threads = krealloc(new_parent->threads, (new_parent->threads_size + 10) * sizeof(int64_t));
+    if (index == -1) {
+        new_parent->threads = krealloc(new_parent->threads, (new_parent->threads_size + 10) * sizeof(int64_t));
         index = new_parent->threads_size;
         new_parent->threads_size += 10;
     }
     new_parent->threads[index] = thread->tid;
 
+    if (thread->state == READY) {
+        rq_enqueue(rq_select_cpu(thread), thread, RQ_ENQUEUE_NEW);
+    }
+
     interrupt_safe_unlock(sched_lock);
     return new_tid;
 }
 
-/* Add a new thread to the dynarray and as a child of a process */
+/* Give a new thread a TID and add it as a child of a process */
 int64_t add_new_child_thread(thread_t *thread, int64_t pid) {
     interrupt_safe_lock(sched_lock);
 
     int64_t index = -1;
 
     /* Find the parent process */
-    process_t *new_parent = (void *) 0;
-    if ((uint64_t) pid < process_list_size) {
-        new_parent = processes[pid];
-    }
-    if (!new_parent) { sprintf("[Scheduler] Couldn't find parent\n"); return -1; }
+    process_t *new_parent = get_process(pid);
+    if (!new_parent) { sprintf("[Scheduler] Couldn't find parent\n"); interrupt_safe_unlock(sched_lock); return -1; }
 
     /* Store the new task and save its TID */
 
-    int64_t new_tid = -1;
-    for (uint64_t i = 0; i < threads_list_size; i++) {
-        if (!threads[i]) {
-            new_tid = i;
-            break;
-        }
-    }
-    if (new_tid == -1) {
-        threads = krealloc(threads, (threads_list_size + 10) * sizeof(thread_t *));
-        new_tid = threads_list_size;
-        threads_list_size += 10;
-    }
-    threads[new_tid] = thread;
+    int64_t new_tid = idr_alloc(&thread_ids, thread);
 
     thread->tid = new_tid;
     thread->regs.cr3 = new_parent->cr3; // Inherit parent's cr3
@@ -398,13 +382,17 @@ done:
             break;
         }
     }
-    if (new_tid == -1) {
-        threads = krealloc(new_parent->threads, (new_parent->threads_size + 10) * sizeof(int64_t));
+    if (index == -1) {
+        new_parent->threads = krealloc(new_parent->threads, (new_parent->threads_size + 10) * sizeof(int64_t));
         index = new_parent->threads_size;
         new_parent->threads_size += 10;
     }
     new_parent->threads[index] = thread->tid;
 
+    if (thread->state == READY) {
+        rq_enqueue(rq_select_cpu(thread), thread, RQ_ENQUEUE_NEW);
+    }
+
     interrupt_safe_unlock(sched_lock);
     return new_tid;
 }
@@ -433,20 +421,8 @@ process_t *create_process(char *name, void *new_cr3) {
 int64_t add_process(process_t *process) {
     interrupt_safe_lock(sched_lock);
 
-    /* Add element to the dynarray and save the PID */
-    int64_t pid = -1;
-    for (uint64_t i = 0; i < process_list_size; i++) {
-        if (!processes[i]) {
-            pid = i;
-            break;
-        }
-    }
-    if (pid == -1) {
-        processes = krealloc(processes, (process_list_size + 10) * sizeof(process_t *));
-        pid = process_list_size;
-        process_list_size += 10;
-    }
-    processes[pid] = process;
+    /* Allocate a PID */
+    int64_t pid = idr_alloc(&process_ids, process);
 
     interrupt_safe_unlock(sched_lock);
 
@@ -469,205 +445,174 @@ int64_t new_process(char *name, void *new_cr3) {
 /* Wrapper for some other parts of the "API" */
 void new_kernel_process(char *name, void (*main)()) {
     int64_t task_parent_pid = new_process(name, (void *) base_kernel_cr3);
-    uint64_t new_rsp = (uint64_t) kcalloc(TASK_STACK_SIZE) + TASK_STACK_SIZE;
-    new_thread(name, main, new_rsp, task_parent_pid, 0);
+    add_new_child_thread(create_kthread(name, main), task_parent_pid);
 }
 
-int64_t pick_task() {
-    int64_t tid_ret = -1;
-
-    if (!(get_cpu_locals()->current_thread)) {
-        return tid_ret;
-    }
+static void schedule_voluntary();
 
-    /* Prioritze tasks right after the current task */
-    for (int64_t t = get_cpu_locals()->current_thread->tid + 1; (uint64_t) t < threads_list_size; t++) {
-        //sprintf("Looking at t = %ld in first loop\n", t);
-        thread_t *task = threads[t];
-        if (task) {
-            if (task->state == READY || task->state == WAIT_EVENT || task->state == WAIT_EVENT_TIMEOUT) {
-                tid_ret = task->tid;
-                //sprintf("picked in first loop with state %u and event %lx\n", task->state, task->event);
-                return tid_ret;
-            }
-            if (task->state == SLEEP) {
-                //sprintf("Time left: %lu\n", task->sleep_node->time_left);
-            }
-        }
+/* Take the direct switch_to path when we're a thread on our own stack, and
+   the interrupt path otherwise */
+static void voluntary_switch() {
+    if (!scheduler_enabled) {
+        return;
     }
-
-    /* Then look at the rest of the tasks */
-    for (int64_t t = 0; t < get_cpu_locals()->current_thread->tid + 1; t++) {
-        //sprintf("Looking at t = %ld in second loop\n", t);
-        thread_t *task = threads[t];
-        if (task) {
-            if (task->state == READY || task->state == WAIT_EVENT || task->state == WAIT_EVENT_TIMEOUT) {
-                tid_ret = task->tid;
-                //sprintf("picked in second loop with state %u and event %lx\n", task->state, task->event);
-                return tid_ret;
-            }
-        }
+    interrupt_state_t state = interrupt_lock();
+    if (get_cpu_locals()->current_thread && !get_cpu_locals()->in_irq) {
+        schedule_voluntary();
+    } else {
+        asm volatile("int $254");
     }
-
-    return tid_ret; // Return -1 by default for idle
+    interrupt_unlock(state);
 }
 
 void yield() {
-    if (scheduler_enabled) {
-        interrupt_safe_lock(sched_lock);
-        asm volatile("int $254");
+    thread_t *current = get_cpu_locals()->current_thread;
+    if (current && thread_is_rt(current)) {
+        current->rt_yielded = 1; // Go behind the others of the same priority
+    }
+    if (current) {
+        current->yielding = 1;
     }
+    voluntary_switch();
 }
 
+/* Expects interrupts to be off if the caller changed its own state to block */
 void force_unlocked_schedule() {
-    if (scheduler_enabled) {
-        asm volatile("int $254");
-    }
+    voluntary_switch();
 }
 
-void schedule_bsp(int_reg_t *r) {
-    send_scheduler_ipis();
-
-    if (!spinlock_check_and_lock(&sched_lock.lock_dat)) {
-        sched_lock.current_holder = __FUNCTION__;
-        schedule(r);
-    } else {
-        if (get_cpu_locals()->currently_idle) {
-            get_cpu_locals()->idle_tsc_count += read_tsc() - get_cpu_locals()->idle_start_tsc;
-            get_cpu_locals()->idle_start_tsc = read_tsc();
-        }  else {
-            get_cpu_locals()->active_tsc_count += read_tsc() - get_cpu_locals()->active_start_tsc;
-            get_cpu_locals()->active_start_tsc = read_tsc();
-        }
+static void account_cpu_tsc() {
+    if (get_cpu_locals()->currently_idle) {
+        get_cpu_locals()->idle_tsc_count += read_tsc() - get_cpu_locals()->idle_start_tsc;
+        get_cpu_locals()->idle_start_tsc = read_tsc();
+    }  else {
+        get_cpu_locals()->active_tsc_count += read_tsc() - get_cpu_locals()->active_start_tsc;
+        get_cpu_locals()->active_start_tsc = read_tsc();
     }
 }
 
-void schedule_ap(int_reg_t *r) {
-    if (!spinlock_check_and_lock(&sched_lock.lock_dat)) {
-        sched_lock.current_holder = __FUNCTION__;
+/* Don't preempt a thread in the middle of a sched_lock critical section */
+static int holding_sched_lock() {
+    return sched_lock.lock_dat && sched_lock.cpu_holding_lock == get_cpu_index();
+}
+
+/* Scheduler tick from this CPU's timer, also used as the reschedule IPI */
+void schedule_tick(int_reg_t *r) {
+    this_cpu_ptr(sched_irq_count)->count++;
+    if (!holding_sched_lock() && rq_should_preempt(get_cpu_index(), get_cpu_locals()->current_thread)) {
         schedule(r);
     } else {
-        if (get_cpu_locals()->currently_idle) {
-            get_cpu_locals()->idle_tsc_count += read_tsc() - get_cpu_locals()->idle_start_tsc;
-            get_cpu_locals()->idle_start_tsc = read_tsc();
-        }  else {
-            get_cpu_locals()->active_tsc_count += read_tsc() - get_cpu_locals()->active_start_tsc;
-            get_cpu_locals()->active_start_tsc = read_tsc();
-        }
+        account_cpu_tsc();
+        lapic_timer_program_next();
     }
-    scheduler_ran = 1;
 }
 
-void schedule(int_reg_t *r) {
-    int used_to_be_idle = 0;
-    int used_to_be_active = 0;
-
-    thread_t *running_task = get_cpu_locals()->current_thread;
-    if (running_task) {
-        running_task->regs.rax = r->rax;
-        running_task->regs.rbx = r->rbx;
-        running_task->regs.rcx = r->rcx;
-        running_task->regs.rdx = r->rdx;
-        running_task->regs.rbp = r->rbp;
-        running_task->regs.rdi = r->rdi;
-        running_task->regs.rsi = r->rsi;
-        running_task->regs.r8 = r->r8;
-        running_task->regs.r9 = r->r9;
-        running_task->regs.r10 = r->r10;
-        running_task->regs.r11 = r->r11;
-        running_task->regs.r12 = r->r12;
-        running_task->regs.r13 = r->r13;
-        running_task->regs.r14 = r->r14;
-        running_task->regs.r15 = r->r15;
-
-        running_task->regs.rflags = r->rflags;
-        running_task->regs.rip = r->rip;
-        running_task->regs.rsp = r->rsp;
-
-        running_task->regs.cs = r->cs;
-        running_task->regs.ss = r->ss;
+static uint8_t cpu_apic_id(int cpu) {
+    cpu_locals_t *locals = hashmap_get_elem(cpu_locals_list, cpu);
+    return locals->apic_id;
+}
 
-        running_task->kernel_stack = get_cpu_locals()->thread_kernel_stack;
-        running_task->user_stack = get_cpu_locals()->thread_user_stack;
+/* Make another CPU look at its run queue and timers again */
+void kick_cpu(int cpu) {
+    send_ipi(cpu_apic_id(cpu), (1 << 14) | 253);
+}
 
-        running_task->regs.cr3 = vmm_get_pml4t();
+/* Wait until every other CPU has taken an interrupt, so nothing they were doing
+   with interrupts off before we were called can still be going */
+void sched_synchronize() {
+    uint64_t seen[MAX_CPUS];
+    int self = get_cpu_index();
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!percpu_offsets[cpu] || cpu == self) {
+            continue;
+        }
+        seen[cpu] = __atomic_load_n(&per_cpu_ptr(sched_irq_count, cpu)->count, __ATOMIC_ACQUIRE);
+        kick_cpu(cpu);
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!percpu_offsets[cpu] || cpu == self) {
+            continue;
+        }
+        while (__atomic_load_n(&per_cpu_ptr(sched_irq_count, cpu)->count, __ATOMIC_ACQUIRE) == seen[cpu]) {
+            asm volatile("pause");
+        }
+    }
+}
 
-        running_task->ignore_ring = get_cpu_locals()->ignore_ring;
+/* Make a CPU switch threads as soon as it can */
+void resched_cpu(int cpu) {
+    if (cpu == get_cpu_index()) {
+        get_cpu_locals()->need_resched = 1;
+        lapic_timer_program(get_time_ns()); // Fire right away, in case we aren't in an interrupt
+        return;
+    }
+    cpu_locals_t *locals = hashmap_get_elem(cpu_locals_list, cpu);
+    locals->need_resched = 1;
+    kick_cpu(cpu);
+}
 
-        asm volatile("fxsave %0;"::"m"(running_task->sse_region)); // save sse
+/* Book a thread off the CPU once its registers are saved, except for clearing running */
+static void switch_out(thread_t *prev, int cpu, thread_t *idle_thread) {
+    prev->kernel_stack = get_cpu_locals()->thread_kernel_stack;
+    prev->user_stack = get_cpu_locals()->thread_user_stack;
+    prev->regs.cr3 = vmm_get_pml4t();
+    prev->ignore_ring = get_cpu_locals()->ignore_ring;
 
-        running_task->regs.mxcsr = get_mxcsr();
-        running_task->regs.fcw = get_fcw();
+    fpu_flush(prev);
 
-        running_task->tsc_stopped = read_tsc();
-        running_task->tsc_total += running_task->tsc_stopped - running_task->tsc_started;
-        
-        running_task->cpu = -1;
+    prev->tsc_stopped = read_tsc();
+    prev->tsc_total += prev->tsc_stopped - prev->tsc_started;
 
-        if (running_task->running) {
-            running_task->running = 0;
-        }
+    if (prev != idle_thread) {
+        rq_account(cpu, prev, prev->tsc_stopped - prev->tsc_started);
+        sched_stats_switch_out(prev);
+        prev->last_cpu = cpu;
 
         /* If we were previously running the task, then it is ready again since we are switching */
-        if (running_task->state == RUNNING && running_task->tid != get_cpu_locals()->idle_tid) {
-            running_task->state = READY;
-            assert(running_task->state == READY);
+        if (prev->state == RUNNING) {
+            prev->state = READY;
+            rq_enqueue(cpu, prev, RQ_ENQUEUE_PREEMPTED);
         }
     }
+}
 
-    int64_t tid_run;
-    int64_t picked_first = -1;
-repick_task:
-    // Run the next thread
-    tid_run = pick_task();
-    //sprintf("Picked %ld\n", tid_run);
-    if (tid_run == -1) {
-        /* Idle */
-        get_cpu_locals()->current_thread = threads[get_cpu_locals()->idle_tid];
-        running_task = get_cpu_locals()->current_thread;
-        goto picked;
+/* Called on the new stack once a thread switched out with switch_to is off it */
+void finish_switch(thread_t *prev) {
+    asm volatile("" ::: "memory");
+    prev->running = 0;
+    prev->cpu = -1;
+    asm volatile("mfence" ::: "memory"); // Pairs with kill_thread setting dying then reading cpu
+    if (prev->dying) {
+        reap_thread(prev);
     } else {
-        if (picked_first == -1) {
-            picked_first = tid_run;
-        } else if (picked_first == tid_run) {
-            // welp
-            tid_run = -1;
-            get_cpu_locals()->current_thread = threads[get_cpu_locals()->idle_tid];
-            running_task = get_cpu_locals()->current_thread;
-            goto picked;
-        }
-        thread_t *to_run = threads[tid_run];
-        get_cpu_locals()->current_thread = to_run;
-        running_task = get_cpu_locals()->current_thread;
-        if (to_run->state == WAIT_EVENT) {
-            if (*to_run->event) {
-                atomic_dec((uint32_t *) to_run->event);
-                to_run->state = READY;
-                goto picked;
-            } else {
-                goto repick_task;
-            }
-        } else if (to_run->state == WAIT_EVENT_TIMEOUT) {
-            if (*to_run->event) {
-                atomic_dec((uint32_t *) to_run->event);
-                to_run->state = READY;
-                goto picked;
-            } else if (to_run->event_wait_start - global_ticks >= to_run->event_timeout) {
-                to_run->state = READY;
-                goto picked;
-            } else {
-                goto repick_task;
-            }
+        rq_finish_wake(prev); // Woken while it was still switching out
+    }
+}
+
+/* Pick what runs next and set the CPU up for it, everything but the registers */
+static thread_t *switch_in(int cpu, thread_t *idle_thread) {
+    int used_to_be_idle = 0;
+    int used_to_be_active = 0;
+
+    thread_t *next;
+    while ((next = rq_pick_next(cpu))) {
+        next->cpu = cpu;
+        asm volatile("mfence" ::: "memory");
+        if (!next->dying) {
+            break;
         }
+        next->cpu = -1; // Killed right as we took it, it doesn't get to run again
+        reap_thread(next);
+    }
+    if (!next) {
+        next = idle_thread;
     }
+    get_cpu_locals()->current_thread = next;
 
-picked:
-    if (tid_run != -1) {
-        assert(running_task->state == READY);
-        assert(running_task->running == 0);
-        running_task->running = 1;
-        running_task->state = RUNNING;
-        assert(running_task->state == RUNNING);
+    if (next != idle_thread) {
+        assert(next->state == READY);
+        next->running = 1;
+        next->state = RUNNING;
         if (get_cpu_locals()->currently_idle) {
             get_cpu_locals()->idle_tsc_count += read_tsc() - get_cpu_locals()->idle_start_tsc;
             used_to_be_idle = 1;
@@ -681,44 +626,23 @@ picked:
         get_cpu_locals()->currently_idle = 1;
     }
 
-    running_task->cpu = (int) get_cpu_locals()->cpu_index;
-
-    r->rax = running_task->regs.rax;
-    r->rbx = running_task->regs.rbx;
-    r->rcx = running_task->regs.rcx;
-    r->rdx = running_task->regs.rdx;
-    r->rbp = running_task->regs.rbp;
-    r->rdi = running_task->regs.rdi;
-    r->rsi = running_task->regs.rsi;
-    r->r8 = running_task->regs.r8;
-    r->r9 = running_task->regs.r9;
-    r->r10 = running_task->regs.r10;
-    r->r11 = running_task->regs.r11;
-    r->r12 = running_task->regs.r12;
-    r->r13 = running_task->regs.r13;
-    r->r14 = running_task->regs.r14;
-    r->r15 = running_task->regs.r15;
-
-    r->rflags = running_task->regs.rflags;
-    r->rip = running_task->regs.rip;
-    r->rsp = running_task->regs.rsp;
-
-    get_cpu_locals()->ignore_ring = running_task->ignore_ring;
+    next->cpu = cpu;
+    if (next != idle_thread) {
+        sched_stats_switch_in(next, cpu);
+    }
+    rq_set_current(cpu, next, next == idle_thread);
 
-    asm volatile("fxrstor %0;"::"m"(running_task->sse_region)); // restore sse
-    set_mxcsr(running_task->regs.mxcsr);
-    set_fcw(running_task->regs.fcw);
+    get_cpu_locals()->ignore_ring = next->ignore_ring;
 
-    r->cs = running_task->regs.cs;
-    r->ss = running_task->regs.ss;
+    fpu_switch_in(next, cpu);
 
-    write_msr(0xC0000100, running_task->regs.fs); // Set FS.base
+    write_msr(0xC0000100, next->regs.fs); // Set FS.base
 
-    get_cpu_locals()->thread_kernel_stack = running_task->kernel_stack;
-    get_cpu_locals()->thread_user_stack = running_task->user_stack;
+    get_cpu_locals()->thread_kernel_stack = next->kernel_stack;
+    get_cpu_locals()->thread_user_stack = next->user_stack;
 
-    if (vmm_get_pml4t() != running_task->regs.cr3) {
-        vmm_set_pml4t(running_task->regs.cr3);
+    if (vmm_get_pml4t() != next->regs.cr3) {
+        vmm_set_pml4t(next->regs.cr3);
     }
 
     if (get_cpu_locals()->currently_idle) {
@@ -733,43 +657,167 @@ picked:
         get_cpu_locals()->active_start_tsc = read_tsc();
     }
 
-    running_task->tsc_started = read_tsc();
+    next->tsc_started = read_tsc();
+    next->cputime_tsc = next->tsc_started;
 
     get_cpu_locals()->total_tsc = read_tsc();
+    return next;
+}
 
-    interrupt_safe_unlock(sched_lock);
+/* Interrupt path, used for preemption. Swaps the interrupt frame for the next thread's. */
+void schedule(int_reg_t *r) {
+    this_cpu_ptr(sched_irq_count)->count++;
+    int cpu = (int) get_cpu_locals()->cpu_index;
+    thread_t *idle_thread = get_cpu_locals()->idle_thread;
+    get_cpu_locals()->need_resched = 0;
+
+    thread_t *running_task = get_cpu_locals()->current_thread;
+    if (running_task) {
+        running_task->regs.rax = r->rax;
+        running_task->regs.rbx = r->rbx;
+        running_task->regs.rcx = r->rcx;
+        running_task->regs.rdx = r->rdx;
+        running_task->regs.rbp = r->rbp;
+        running_task->regs.rdi = r->rdi;
+        running_task->regs.rsi = r->rsi;
+        running_task->regs.r8 = r->r8;
+        running_task->regs.r9 = r->r9;
+        running_task->regs.r10 = r->r10;
+        running_task->regs.r11 = r->r11;
+        running_task->regs.r12 = r->r12;
+        running_task->regs.r13 = r->r13;
+        running_task->regs.r14 = r->r14;
+        running_task->regs.r15 = r->r15;
+
+        running_task->regs.rflags = r->rflags;
+        running_task->regs.rip = r->rip;
+        running_task->regs.rsp = r->rsp;
+
+        running_task->regs.cs = r->cs;
+        running_task->regs.ss = r->ss;
+        running_task->switch_rsp = 0;
+
+        switch_out(running_task, cpu, idle_thread);
+
+        /* Registers are saved, other CPUs can pick the task up now */
+        finish_switch(running_task);
+    }
+
+    running_task = switch_in(cpu, idle_thread);
+
+    if (running_task->switch_rsp) {
+        /* It left through switch_to, so iret into the tail of switch_to on its own stack */
+        r->rip = (uint64_t) switch_resume;
+        r->rsp = running_task->switch_rsp;
+        r->rflags = 0x2; // switch_to is always entered with interrupts off
+        r->cs = 0x8;
+        r->ss = 0x10;
+        running_task->switch_rsp = 0;
+    } else {
+        r->rax = running_task->regs.rax;
+        r->rbx = running_task->regs.rbx;
+        r->rcx = running_task->regs.rcx;
+        r->rdx = running_task->regs.rdx;
+        r->rbp = running_task->regs.rbp;
+        r->rdi = running_task->regs.rdi;
+        r->rsi = running_task->regs.rsi;
+        r->r8 = running_task->regs.r8;
+        r->r9 = running_task->regs.r9;
+        r->r10 = running_task->regs.r10;
+        r->r11 = running_task->regs.r11;
+        r->r12 = running_task->regs.r12;
+        r->r13 = running_task->regs.r13;
+        r->r14 = running_task->regs.r14;
+        r->r15 = running_task->regs.r15;
+
+        r->rflags = running_task->regs.rflags;
+        r->rip = running_task->regs.rip;
+        r->rsp = running_task->regs.rsp;
+
+        r->cs = running_task->regs.cs;
+        r->ss = running_task->regs.ss;
+    }
+
+    lapic_timer_program_next();
+}
+
+/* Voluntary path. Only the callee saved registers and the stack pointer get saved,
+   on the thread's own kernel stack. Expects interrupts to be off. */
+static void schedule_voluntary() {
+    int cpu = (int) get_cpu_locals()->cpu_index;
+    thread_t *idle_thread = get_cpu_locals()->idle_thread;
+    thread_t *prev = get_cpu_locals()->current_thread;
+    get_cpu_locals()->need_resched = 0;
+
+    switch_out(prev, cpu, idle_thread);
+    thread_t *next = switch_in(cpu, idle_thread); // prev is still marked running, only we can pick it
+    lapic_timer_program_next();
+
+    if (next == prev) {
+        return; // Got picked again right away
+    }
+
+    if (next->switch_rsp) {
+        uint64_t next_rsp = next->switch_rsp;
+        next->switch_rsp = 0;
+        switch_to(&prev->switch_rsp, next_rsp, prev);
+    } else {
+        /* It was preempted or never ran, build an iret frame for it on a stack it isn't using */
+        uint64_t frame_rsp;
+        if (next->regs.cs == 0x8) {
+            frame_rsp = (next->regs.rsp - 64) & ~0xFULL;
+        } else {
+            frame_rsp = next->kernel_stack & ~0xFULL;
+        }
+        switch_to_frame(&prev->switch_rsp, &next->regs, frame_rsp, prev);
+    }
+    /* We're back, whoever switched to us did the bookkeeping */
 }
 
 int kill_task(int64_t tid) {
     urm_kill_thread_data data;
+    init_work(&data.work, urm_kill_thread);
     data.tid = tid;
     if (tid == get_cpu_locals()->current_thread->tid) {
-        send_urm_request_async(&data, URM_KILL_THREAD); // blah
+        data.work.detached = 1; // Our stack goes with us
+        queue_work(&data.work);
         while (1) { asm("hlt"); } // wait for death
-    } else {
-        send_urm_request(&data, URM_KILL_THREAD);
     }
-    
+    queue_work(&data.work);
+    flush_work(&data.work);
     return 0;
 }
 
 int kill_process(int64_t pid) {
     urm_kill_process_data data;
+    init_work(&data.work, urm_kill_process);
     data.pid = pid;
+    data.heap = 0;
     if (pid == get_cpu_locals()->current_thread->parent_pid) {
-        send_urm_request_async(&data, URM_KILL_PROCESS);
+        data.work.detached = 1;
+        queue_work(&data.work);
         while (1) { asm("hlt"); }
-    } else {
-        send_urm_request(&data, URM_KILL_PROCESS);
     }
+    queue_work(&data.work);
+    flush_work(&data.work);
     return 0;
 }
 
+/* Queue a process kill without waiting on it, for interrupt handlers */
+void kill_process_async(int64_t pid) {
+    urm_kill_process_data *data = kcalloc(sizeof(urm_kill_process_data));
+    init_work(&data->work, urm_kill_process);
+    data->work.detached = 1;
+    data->heap = 1;
+    data->pid = pid;
+    queue_work(&data->work);
+}
+
 
 int map_user_memory(int pid, void *phys, void *virt, uint64_t size, uint16_t perms) {
     interrupt_safe_lock(sched_lock);
     size = ((size + 0x1000 - 1) / 0x1000);
-    process_t *process = processes[pid];
+    process_t *process = get_process(pid);
     if (!process) return -1;
 
     void *cr3 = (void *) process->cr3;
@@ -781,7 +829,7 @@ int map_user_memory(int pid, void *phys, void *virt, uint64_t size, uint16_t per
 int unmap_user_memory(int pid, void *virt, uint64_t size) {
     interrupt_safe_lock(sched_lock);
     size = ((size + 0x1000 - 1) / 0x1000);
-    process_t *process = processes[pid];
+    process_t *process = get_process(pid);
     if (!process) return -1;
 
     void *cr3 = (void *) process->cr3;
@@ -793,7 +841,7 @@ int unmap_user_memory(int pid, void *virt, uint64_t size) {
 void *psuedo_mmap(void *base, uint64_t len, syscall_reg_t *r) {
     interrupt_safe_lock(sched_lock);
     len = (len + 0x1000 - 1) / 0x1000;
-    process_t *process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *process = get_process(get_cpu_locals()->current_thread->parent_pid);
     if (!process) { r->rdx = ESRCH; interrupt_safe_unlock(sched_lock); return (void *) 0; } // bruh
 
     void *phys = pmm_alloc(len * 0x1000);
@@ -880,7 +928,7 @@ void *psuedo_mmap(void *base, uint64_t len, syscall_reg_t *r) {
 int munmap(char *addr, uint64_t len) {
     interrupt_safe_lock(sched_lock);
     len = (len + 0x1000 - 1) / 0x1000;
-    process_t *process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
     if (!process) { return -ESRCH; } // bruh
 
@@ -906,25 +954,12 @@ int munmap(char *addr, uint64_t len) {
 int fork(syscall_reg_t *r) {
     sprintf("got fork call with r = %lx\n", r);
     interrupt_safe_lock(sched_lock);
-    process_t *process = processes[get_cpu_locals()->current_thread->parent_pid]; // Old process
+    process_t *process = get_process(get_cpu_locals()->current_thread->parent_pid); // Old process
     void *new_cr3 = vmm_fork((void *) process->cr3); // Fork address space
 
     process_t *forked_process = create_process(process->name, new_cr3);
-    int64_t new_pid = -1;
-    for (uint64_t i = 0; i < process_list_size; i++) {
-        if (!processes[i]) {
-            new_pid = i;
-            break;
-        }
-    }
-    if (new_pid == -1) {
-        processes = krealloc(processes, (process_list_size + 10) * sizeof(process_t *));
-        new_pid = process_list_size;
-        process_list_size += 10;
-    }
-    processes[new_pid] = forked_process;
-
-    process_t *new_process = processes[new_pid]; // Get the process struct
+    int64_t new_pid = idr_alloc(&process_ids, forked_process);
+    process_t *new_process = forked_process;
     int64_t old_pid = process->pid;
     interrupt_safe_unlock(sched_lock);
 
@@ -949,6 +984,9 @@ int fork(syscall_reg_t *r) {
     thread_t *old_thread = get_cpu_locals()->current_thread;
 
     thread_t *thread = create_thread(old_thread->name, (void (*)()) old_thread->regs.rip, old_thread->regs.rsp, old_thread->ring);
+    set_thread_nice(thread, old_thread->nice);
+    set_thread_policy(thread, old_thread->base_policy, old_thread->base_rt_priority);
+    thread->affinity = old_thread->affinity;
     thread->regs.rax = 0;
     thread->regs.rbx = r->rbx;
     thread->regs.rcx = r->rcx;
@@ -967,7 +1005,10 @@ int fork(syscall_reg_t *r) {
     thread->regs.rsp = get_cpu_locals()->thread_user_stack;
     thread->regs.rip = r->rcx;
     thread->regs.rflags = r->r11;
-    memcpy((uint8_t *) old_thread->sse_region, (uint8_t *) thread->sse_region, 512);
+    interrupt_state_t fpu_state = interrupt_lock();
+    fpu_flush(old_thread); // Our live state might only be in the registers
+    memcpy((uint8_t *) old_thread->fpu_state, (uint8_t *) thread->fpu_state, FPU_STATE_SIZE);
+    interrupt_unlock(fpu_state);
 
     interrupt_safe_unlock(sched_lock);
 
@@ -977,71 +1018,80 @@ int fork(syscall_reg_t *r) {
     return new_pid;
 }
 
-void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
-    r->rdx = 0;
-    uint64_t argc = 0;
-    uint64_t envc = 0;
-    int found_null_argv = 0;
-    int found_null_envp = 0;
-
-    for (uint64_t i = 0; i < 128; i++) {
-        if (!range_mapped((void *) ((uint64_t) argv + (sizeof(char *) * i)), sizeof(char *)) || ((uint64_t) argv + 8 + (sizeof(char *) * i)) > 0x7fffffffffff) {
-            r->rdx = EFAULT;
-            return;
-        }
-        if (!argv[i]) {
-            found_null_argv = 1;
-            break;
+static void free_string_array(char **array, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (array[i]) {
+            kfree(array[i]);
         }
-        argc++;
     }
+    kfree(array);
+}
 
+/* Copy a NULL terminated array of up to 128 strings out of userspace. Returns 0 if it faulted. */
+static int copy_string_array(char **user_array, char ***array_out, uint64_t *count_out) {
+    uint64_t count = 0;
+    int found_null = 0;
     for (uint64_t i = 0; i < 128; i++) {
-        if (!range_mapped((void *) ((uint64_t) envp + (sizeof(char *) * i)), sizeof(char *)) || ((uint64_t) envp + 8 + (sizeof(char *) * i)) > 0x7fffffffffff) {
-            r->rdx = EFAULT;
-            return;
+        if (!range_mapped((void *) ((uint64_t) user_array + (sizeof(char *) * i)), sizeof(char *)) || ((uint64_t) user_array + 8 + (sizeof(char *) * i)) > 0x7fffffffffff) {
+            return 0;
         }
-        if (!envp[i]) {
-            found_null_envp = 1;
+        if (!user_array[i]) {
+            found_null = 1;
             break;
         }
-        envc++;
+        count++;
     }
-
-    if (!found_null_argv || !found_null_envp) {
-        r->rdx = EFAULT;
-        return;
+    if (!found_null) {
+        return 0;
     }
 
-    char **kernel_argv = kcalloc(sizeof(char *) * argc);
-    char **kernel_envp = kcalloc(sizeof(char *) * envc);
-    char *kernel_exec_path = (void *) 0;
-
-    for (uint64_t i = 0; i < argc; i++) {
-        char *string = argv[i];
-        void *kernel_string = check_and_copy_string(string);
-        if (!kernel_string) {
-            goto fault_return;
+    char **array = kcalloc(sizeof(char *) * count);
+    for (uint64_t i = 0; i < count; i++) {
+        array[i] = check_and_copy_string(user_array[i]);
+        if (!array[i]) {
+            free_string_array(array, count);
+            return 0;
         }
-
-        kernel_argv[i] = kernel_string;
     }
+    *array_out = array;
+    *count_out = count;
+    return 1;
+}
 
-    for (uint64_t i = 0; i < envc; i++) {
-        char *string = envp[i];
-        void *kernel_string = check_and_copy_string(string);
-        if (!kernel_string) {
-            goto fault_return;
-        }
-
-        kernel_envp[i] = kernel_string;
+/* Copy the path, argv and envp for execve or spawn into the kernel. Returns 0 if any of it faulted. */
+static int copy_exec_args(char *executable_path, char **argv, char **envp, char **path_out,
+                          char ***argv_out, uint64_t *argc_out, char ***envp_out, uint64_t *envc_out) {
+    if (!copy_string_array(argv, argv_out, argc_out)) {
+        return 0;
+    }
+    if (!copy_string_array(envp, envp_out, envc_out)) {
+        free_string_array(*argv_out, *argc_out);
+        return 0;
     }
+    *path_out = check_and_copy_string(executable_path);
+    if (!*path_out) {
+        free_string_array(*argv_out, *argc_out);
+        free_string_array(*envp_out, *envc_out);
+        return 0;
+    }
+    return 1;
+}
 
-    kernel_exec_path = check_and_copy_string(executable_path);
-    if (!kernel_exec_path) {
-        goto fault_return;
+void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
+    r->rdx = 0;
+    char *kernel_exec_path;
+    char **kernel_argv;
+    char **kernel_envp;
+    uint64_t argc;
+    uint64_t envc;
+    if (!copy_exec_args(executable_path, argv, envp, &kernel_exec_path, &kernel_argv, &argc, &kernel_envp, &envc)) {
+        r->rdx = EFAULT;
+        return;
     }
+
     urm_execve_data data;
+    init_work(&data.work, urm_execve);
+    data.work.detached = 1; // Kills us if it works, it completes the work itself if it doesn't
     data.argv = kernel_argv;
     data.envp = kernel_envp;
     data.executable_path = kernel_exec_path;
@@ -1049,118 +1099,75 @@ void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
     data.argc = argc;
     data.pid = get_cpu_locals()->current_thread->parent_pid;
     data.tid = get_cpu_locals()->current_thread->tid;
-    int ret = send_urm_request(&data, URM_EXECVE);
-    goto done;
+    queue_work(&data.work);
+    flush_work(&data.work); // Only comes back if it failed
 
-fault_return:
-    for (uint64_t x = 0; x < argc; x++) {
-        if (kernel_argv[x]) {
-            kfree(kernel_argv[x]);
-        }
-    }
-    kfree(kernel_argv);
-    for (uint64_t x = 0; x < envc; x++) {
-        if (kernel_envp[x]) {
-            kfree(kernel_envp[x]);
-        }
-    }
-    kfree(kernel_envp);
-    if (kernel_exec_path) {
-        kfree(kernel_exec_path);
-    }
-    r->rdx = EFAULT;
-    return;
-done:
-    sprintf("returning\n");
-    for (uint64_t x = 0; x < argc; x++) {
-        if (kernel_argv[x]) {
-            kfree(kernel_argv[x]);
-        }
-    }
-    kfree(kernel_argv);
-    for (uint64_t x = 0; x < envc; x++) {
-        if (kernel_envp[x]) {
-            kfree(kernel_envp[x]);
-        }
-    }
-    kfree(kernel_envp);
-    if (kernel_exec_path) {
-        kfree(kernel_exec_path);
-    }
-    r->rdx = ret; // return error :(
-}
-
-void set_fs_base_syscall(uint64_t base) {
-    get_cpu_locals()->current_thread->regs.fs = base;
-    write_msr(0xC0000100, get_cpu_locals()->current_thread->regs.fs); // Set the FS base in case the scheduler hasn't rescheduled
+    free_string_array(kernel_argv, argc);
+    free_string_array(kernel_envp, envc);
+    kfree(kernel_exec_path);
+    r->rdx = data.ret; // return error :(
 }
 
-/* Wake a single thread that is waiting on the futex */
-int futex_wake(uint32_t *futex) {
-    lock(futex_lock);
-    if (!futex_waiters) {
-        unlock(futex_lock);
-        return 0;
-    }
-
-    futex_wait_list_t *waiting_threads = hashmap_get_elem(futex_waiters, (uint64_t) futex);
-    if (!waiting_threads) { // no one is waiting
-        unlock(futex_lock);
-        return 0;
+/* Start a program in a new child process, without copying ours just to throw it away
+   like fork and execve would. It gets our fds, ids and scheduling settings. */
+int64_t spawn(char *executable_path, char **argv, char **envp, syscall_reg_t *r) {
+    r->rdx = 0;
+    char *kernel_exec_path;
+    char **kernel_argv;
+    char **kernel_envp;
+    uint64_t argc;
+    uint64_t envc;
+    if (!copy_exec_args(executable_path, argv, envp, &kernel_exec_path, &kernel_argv, &argc, &kernel_envp, &envc)) {
+        r->rdx = EFAULT;
+        return -1;
     }
 
-    for (uint32_t i = 0; i < waiting_threads->count; i++) {
-        if (waiting_threads->waiting[i]) {
-            interrupt_safe_lock(sched_lock);
-            waiting_threads->waiting[i]->state = READY;
-            interrupt_safe_unlock(sched_lock);
-
-            waiting_threads->waiting[i] = NULL;
-            break;
-        }
+    uint64_t entry_point = 0;
+    auxv_auxc_group_t auxv_info;
+    void *address_space = load_elf_addrspace(kernel_exec_path, &entry_point, 0, NULL, &auxv_info);
+    if (!address_space) {
+        free_string_array(kernel_argv, argc);
+        free_string_array(kernel_envp, envc);
+        kfree(kernel_exec_path);
+        r->rdx = ENOENT;
+        return -1;
     }
 
-    unlock(futex_lock);
-    return 0;
-}
+    thread_t *old_thread = get_cpu_locals()->current_thread;
+    int64_t old_pid = old_thread->parent_pid;
+    process_t *new_process = create_process(kernel_exec_path, address_space);
+    new_process->ppid = old_pid;
 
-int futex_wait(uint32_t *futex, uint32_t expected_value) {
-    uint32_t *higher_half_futex = GET_HIGHER_HALF(void *, futex);
-    lock(futex_lock);
-    if (*higher_half_futex != expected_value) {
-        unlock(futex_lock);
-        return 1;
+    interrupt_safe_lock(sched_lock);
+    process_t *process = get_process(old_pid);
+    if (process) { // We're being killed otherwise, the child is an orphan either way
+        new_process->uid = process->uid;
+        new_process->gid = process->gid;
     }
+    int64_t new_pid = idr_alloc(&process_ids, new_process);
+    interrupt_safe_unlock(sched_lock);
 
-    if (!futex_waiters) {
-        futex_waiters = init_hashmap();
-    }
-    
-    futex_wait_list_t *waiting_threads = hashmap_get_elem(futex_waiters, (uint64_t) futex);
-    if (!waiting_threads) {
-        waiting_threads = kcalloc(sizeof(futex_wait_list_t));
-        hashmap_set_elem(futex_waiters, (uint64_t) futex, waiting_threads);
-    }
+    clone_fds(old_pid, new_pid);
 
-    interrupt_safe_lock(sched_lock);
-    thread_t *cur_thread = get_cpu_locals()->current_thread;
-    int64_t index = -1;
-    for (uint32_t i = 0; i < waiting_threads->count; i++) {
-        if (!waiting_threads->waiting[i]) {
-            index = i;
-            break;
-        }
+    thread_t *thread = create_thread(kernel_exec_path, (void *) entry_point, USER_STACK, 3);
+    set_thread_nice(thread, old_thread->nice);
+    set_thread_policy(thread, old_thread->base_policy, old_thread->base_rt_priority);
+    thread->affinity = old_thread->affinity;
+    if (auxv_info.auxv) {
+        thread->vars.auxc = auxv_info.auxc;
+        thread->vars.auxv = auxv_info.auxv;
     }
+    thread->vars.envc = envc;
+    thread->vars.argc = argc;
+    thread->vars.enviroment = kernel_envp; // The thread owns these now
+    thread->vars.argv = kernel_argv;
+    kfree(kernel_exec_path);
 
-    if (index == -1) {
-        index = waiting_threads->count++;
-        waiting_threads->waiting = krealloc(waiting_threads->waiting, waiting_threads->count * sizeof(thread_t *));
-    }
+    add_new_child_thread(thread, new_pid);
+    return new_pid;
+}
 
-    waiting_threads->waiting[index] = cur_thread;
-    cur_thread->state = BLOCKED;
-    
-    unlock(futex_lock);
-    force_unlocked_schedule();
-    return 0;
-}
\ No newline at end of file
+void set_fs_base_syscall(uint64_t base) {
+    get_cpu_locals()->current_thread->regs.fs = base;
+    write_msr(0xC0000100, get_cpu_locals()->current_thread->regs.fs); // Set the FS base in case the scheduler hasn't rescheduled
+}
@@ -6,14 +6,19 @@
 #include "klibc/rangemap.h"
 #include "klibc/hashmap.h"
 #include "klibc/lock.h"
+#include "klibc/rbtree.h"
+#include "klibc/idr.h"
 #include "fs/fd.h"
+#include "sys/cpumask.h"
+#include "sched_stats.h"
 
 #define READY 0
 #define RUNNING 1
 #define BLOCKED 2
 #define SLEEP 3
-#define WAIT_EVENT 4
-#define WAIT_EVENT_TIMEOUT 5
+#define WAITING 4
+
+#define FPU_STATE_SIZE 1024 // Fits x87, SSE and AVX
 
 #define TASK_STACK_SIZE 0x4000
 #define TASK_STACK_PAGES (TASK_STACK_SIZE + 0x1000 - 1) / 0x1000
@@ -28,14 +33,13 @@ typedef struct {
     uint64_t r15, r14, r13, r12, r11, r10, r9, r8, rsi, rdi, rbp, rdx, rcx, rbx, rax;
 } __attribute__((packed)) syscall_reg_t;
 
+/* switch.asm reads this by offset, keep the layout in sync */
 typedef struct {
     uint64_t rax, rbx, rcx, rdx, rbp, rdi, rsi, r8, r9, r10, r11, r12, r13, r14, r15;
     uint64_t rsp, rip;
     uint64_t ss, cs, fs;
     uint64_t rflags;
     uint64_t cr3;
-    uint32_t mxcsr;
-    uint16_t fcw;
 } task_regs_t;
 
 typedef struct {
@@ -62,12 +66,14 @@ typedef struct {
     int auxc;
 } main_thread_vars_t;
 
-typedef struct {
+typedef struct thread {
     char name[50]; // The name of the task
 
     task_regs_t regs; // The task's registers
+    uint64_t switch_rsp; // Kernel stack pointer saved by switch_to, 0 if regs holds the context
 
     uint64_t kernel_stack;
+    uint64_t kthread_stack; // Top of the ring 0 stack create_kthread gave it, 0 if someone else owns its stack
     uint64_t user_stack;
 
     uint64_t tsc_started; // The last time this task was started
@@ -76,23 +82,62 @@ typedef struct {
 
     uint8_t state; // State of the task
     int cpu; // CPU the task is running on
+    int last_cpu; // CPU the task last ran on
+    cpumask_t affinity; // CPUs the task may run on
+    uint8_t bound; // Affinity can't be changed, for per-CPU kernel threads
+    volatile uint8_t dying; // Killed, whichever CPU sees it off-CPU first drops it
+    uint8_t reaped; // Claimed by reap_thread, so it's only freed once
+    struct thread *zombie_next; // Link in the per-CPU list waiting to be freed
+    struct dead_mm *dead_mm; // Address space it pins until it's freed, if set
+
+    rb_node_t rq_node; // Run queue link
+    int rq_cpu; // Run queue the task is queued on, -1 if it isn't queued
+
+    uint64_t vruntime; // Runtime in ns, scaled by weight
+    int nice;
+    uint32_t weight;
+    uint64_t wake_tsc; // When the thread was last woken, 0 once it ran
+    uint64_t ready_tsc; // When it was last woken or preempted, 0 once it ran
+    uint8_t block_kind; // BLOCK_ kind it went off the CPU with, for the stats
+    uint8_t yielding; // Gave up the CPU itself while staying ready
+    thread_stats_t stats;
+    uint64_t cputime_tsc; // Last time it went between user and kernel, or got the CPU
+    uint64_t utime_tsc; // Time spent in userspace
+    uint64_t stime_tsc; // Time spent in the kernel
+
+    uint8_t policy; // SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+    uint8_t rt_priority; // Real-time priority, higher runs first
+    uint8_t base_policy; // What policy and priority were set to, before any PI boost
+    uint8_t base_rt_priority;
+    uint64_t rt_slice_used; // ns of the RR slice used up
+    uint8_t rt_yielded; // Requeue at the back of its priority
+    struct thread *rt_next; // Real-time queue links
+    struct thread *rt_prev;
 
     int64_t tid; // Task ID
     int64_t parent_pid; // The pid of the parent process
     uint8_t ring;
 
-    uint8_t running;
-    sleep_queue_t *sleep_node;
+    volatile uint8_t running; // Set while a CPU is using the task's registers
+    volatile uint8_t wake_pending; // Woken while still running, queued once it's off its CPU
+    ktimer_t sleep_timer;
 
     main_thread_vars_t vars;
 
-    int *event;
-    uint64_t event_timeout;
-    uint64_t event_wait_start;
+    struct thread *wq_next; // Wait queue links
+    struct thread *wq_prev;
+    struct wait_queue *wait_queue; // Queue the task is waiting on, if any
+    uint64_t futex_key; // Futex the task is waiting on, if it's in a futex bucket
+    struct pi_state *pi_blocked_on; // PI futex the task is waiting to own
+    struct pi_state *pi_owned; // PI futexes the task owns that have waiters
+    struct thread *pi_next; // Link in the waiters of pi_blocked_on
+    uint8_t timed_out;
+    ktimer_t timeout_timer;
 
     uint8_t ignore_ring; // for error checking
 
-    char sse_region[512] __attribute__((aligned(16))); // SSE region (aligned)
+    int fpu_cpu; // CPU whose FPU registers hold the task's state, -1 if only the save area does
+    uint8_t fpu_state[FPU_STATE_SIZE] __attribute__((aligned(64))); // FXSAVE/XSAVE area
 } thread_t;
 
 typedef struct {
@@ -118,6 +163,12 @@ typedef struct {
     int64_t gid; // Group id of the user running this process
     int64_t ppid; // Parent process id
     uint64_t permissions; // Misc permission flags
+
+    /* CPU time and switches of threads that are gone, for getrusage */
+    uint64_t dead_utime_tsc;
+    uint64_t dead_stime_tsc;
+    uint64_t dead_voluntary_switches;
+    uint64_t dead_involuntary_switches;
 } process_t;
 
 typedef struct {
@@ -135,11 +186,17 @@ typedef struct {
 
 /* Scheduling */
 void schedule(int_reg_t *r);
-void schedule_ap(int_reg_t *r);
-void schedule_bsp(int_reg_t *r);
+void schedule_tick(int_reg_t *r);
+void kick_cpu(int cpu);
+void resched_cpu(int cpu);
+void sched_synchronize();
 void scheduler_init_bsp();
 void scheduler_init_ap();
 void yield();
+void finish_switch(thread_t *prev);
+extern void switch_to(uint64_t *prev_rsp, uint64_t next_rsp, thread_t *prev);
+extern void switch_to_frame(uint64_t *prev_rsp, task_regs_t *next_regs, uint64_t frame_rsp, thread_t *prev);
+extern char switch_resume[];
 void force_unlocked_schedule();
 
 /* "API" */
@@ -148,6 +205,9 @@ int64_t add_new_child_thread_no_stack_init(thread_t *thread, int64_t pid);
 thread_t *create_thread(char *name, void (*main)(), uint64_t rsp, uint8_t ring);
 int64_t start_thread(thread_t *thread);
 int64_t new_thread(char *name, void (*main)(), uint64_t rsp, int64_t pid, uint8_t ring);
+thread_t *create_kthread(char *name, void (*main)());
+thread_t *create_bound_kthread(char *name, void (*main)(), int cpu);
+void destroy_thread(thread_t *thread);
 int64_t new_process(char *name, void *new_cr3);
 void new_kernel_process(char *name, void (*main)());
 void new_user_process(char *name, void (*virt_main)(), void (*phys_main)(), uint64_t code_size);
@@ -161,6 +221,7 @@ void add_env(main_thread_vars_t *vars, char *string);
 
 /* Killing stuff */
 int kill_process(int64_t pid);
+void kill_process_async(int64_t pid);
 int kill_task(int64_t tid);
 
 void start_test_user_task(); // bruh
@@ -177,8 +238,7 @@ int munmap(char *addr, uint64_t len);
 /* Fork, exec, etc */
 int fork(syscall_reg_t *r);
 void execve(char *executable_path, char **argv, char **envp, syscall_reg_t *r);
-int futex_wake(uint32_t *futex);
-int futex_wait(uint32_t *futex, uint32_t expected_value);
+int64_t spawn(char *executable_path, char **argv, char **envp, syscall_reg_t *r);
 void set_fs_base_syscall(uint64_t base);
 
 void start_idle();
@@ -190,9 +250,15 @@ extern lock_t scheduler_lock;
 extern interrupt_safe_lock_t sched_lock;
 extern uint64_t process_count;
 
-extern uint64_t threads_list_size;
-extern uint64_t process_list_size;
-extern thread_t **threads;
-extern process_t **processes;
+extern idr_t thread_ids;
+extern idr_t process_ids;
+
+static inline thread_t *get_thread(int64_t tid) {
+    return idr_find(&thread_ids, tid);
+}
+
+static inline process_t *get_process(int64_t pid) {
+    return idr_find(&process_ids, pid);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+[bits 64]
+[extern finish_switch]
+
+section .text
+
+%macro save_callee_saved 0
+push rbp
+push rbx
+push r12
+push r13
+push r14
+push r15
+%endmacro
+
+; void switch_to(uint64_t *prev_rsp, uint64_t next_rsp, thread_t *prev)
+; Switch to a thread that left through here as well, its callee saved registers are on its stack
+[global switch_to]
+switch_to:
+    save_callee_saved
+    mov qword [rdi], rsp
+    mov rsp, rsi
+    mov rdi, rdx
+    sub rsp, 8 ; Keep the stack aligned for the call
+    call finish_switch
+    add rsp, 8
+[global switch_resume]
+switch_resume: ; The interrupt path irets here to resume a thread that left through switch_to
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; void switch_to_frame(uint64_t *prev_rsp, task_regs_t *next_regs, uint64_t frame_rsp, thread_t *prev)
+; Switch to a thread whose context is in its task_regs_t, by building an iret frame at frame_rsp
+[global switch_to_frame]
+switch_to_frame:
+    save_callee_saved
+    mov qword [rdi], rsp
+    mov rsp, rdx
+    mov rbx, rsi
+    mov rdi, rcx
+    call finish_switch
+
+    push qword [rbx + 136] ; SS
+    push qword [rbx + 120] ; RSP
+    push qword [rbx + 160] ; RFLAGS
+    push qword [rbx + 144] ; CS
+    push qword [rbx + 128] ; RIP
+
+    mov rax, qword [rbx + 0]
+    mov rcx, qword [rbx + 16]
+    mov rdx, qword [rbx + 24]
+    mov rbp, qword [rbx + 32]
+    mov rdi, qword [rbx + 40]
+    mov rsi, qword [rbx + 48]
+    mov r8, qword [rbx + 56]
+    mov r9, qword [rbx + 64]
+    mov r10, qword [rbx + 72]
+    mov r11, qword [rbx + 80]
+    mov r12, qword [rbx + 88]
+    mov r13, qword [rbx + 96]
+    mov r14, qword [rbx + 104]
+    mov r15, qword [rbx + 112]
+    mov rbx, qword [rbx + 8]
+    iretq
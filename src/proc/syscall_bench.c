@@ -0,0 +1,14 @@
+#include "syscall_bench.h"
+#include "proc/exec_formats/raw_binary.h"
+#include "drivers/serial.h"
+#include <stdint.h>
+
+extern uint8_t syscall_bench_code[];
+extern uint8_t syscall_bench_code_end[];
+
+/* Time a million null syscalls from userspace, it prints the TSC cycles per round trip
+   through print_num. Build with -D SYSCALL_BENCH to have the kernel process start it. */
+void launch_syscall_bench() {
+    sprintf("[Bench] Null syscall round trip, in TSC cycles:\n");
+    launch_code("Syscall bench", syscall_bench_code, syscall_bench_code_end - syscall_bench_code);
+}
@@ -0,0 +1,6 @@
+#ifndef SYSCALL_BENCH_H
+#define SYSCALL_BENCH_H
+
+void launch_syscall_bench();
+
+#endif
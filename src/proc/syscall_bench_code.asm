@@ -0,0 +1,47 @@
+[bits 64]
+
+; Null syscall latency benchmark. This runs in ring 3 as its own process, copied there
+; by launch_syscall_bench, so it has to be position independent.
+
+SYS_EXIT equ 12
+SYS_NULL equ 83
+SYS_PRINT_NUM equ 123
+ITERATIONS equ 1000000
+
+section .rodata
+
+global syscall_bench_code
+global syscall_bench_code_end
+syscall_bench_code:
+    ; Warm the path up first
+    mov rax, SYS_NULL
+    syscall
+
+    ; r12 and r13 are callee saved, so they make it through every syscall
+    mov r12, ITERATIONS
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r13, rax
+.loop:
+    mov rax, SYS_NULL
+    syscall
+    dec r12
+    jnz .loop
+
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r13
+    xor edx, edx
+    mov rcx, ITERATIONS
+    div rcx ; TSC cycles per round trip
+    mov rdi, rax
+    mov rax, SYS_PRINT_NUM
+    syscall
+
+    mov rax, SYS_EXIT
+    syscall
+.hang:
+    jmp .hang
+syscall_bench_code_end:
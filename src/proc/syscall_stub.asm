@@ -44,15 +44,39 @@ syscall_stub:
     mov rsp, qword [gs:8]
     pushaq
     cld
+    sti ; Came in with interrupts masked so nothing could land on the user stack
     mov rdi, rsp
     call syscall_handler
+
+    ; Nothing may come in once we're on the user stack, sysret turns interrupts back on
+    cli
+    test eax, eax
+    jz .iret
+
+    ; The C code kept the callee saved registers, only restore what it could have touched
+    add rsp, 32 ; r15, r14, r13, r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rsi
+    pop rdi
+    add rsp, 8 ; rbp
+    pop rdx
+    pop rcx
+    add rsp, 8 ; rbx
+    pop rax
+    mov rsp, qword [gs:16]
+    o64 sysret
+
+.iret:
     popaq
 
     ; Return from the syscall
-    push 0x23 ; SS
+    push 0x1B ; SS
     push qword [gs:16] ; RSP
     push r11 ; RFLAGS
-    push 0x1B ; CS
+    push 0x23 ; CS
     push rcx ; RIP
 
-    iretq
\ No newline at end of file
+    iretq
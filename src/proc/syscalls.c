@@ -5,33 +5,34 @@
 #include "proc/scheduler.h"
 #include "proc/safe_userspace.h"
 #include "proc/ipc.h"
+#include "proc/fair.h"
+#include "proc/rt.h"
+#include "proc/runqueue.h"
+#include "proc/futex.h"
 #include "sys/smp.h"
 #include "sys/apic.h"
+#include "sys/percpu.h"
 #include "klibc/errno.h"
 #include "klibc/stdlib.h"
 
 #include "drivers/serial.h"
 
-int HANDLER_COUNT = 0;
+DEFINE_PER_CPU_COUNTER(syscall_count);
+
 typedef void (*syscall_handler_t)(syscall_reg_t *r);
 
-syscall_handler_t *syscall_handlers = 0;
+static syscall_handler_t syscall_handlers[SYSCALL_COUNT];
 
 void register_syscall(int num, syscall_handler_t handler) {
-    if (HANDLER_COUNT < num+1) {
-        syscall_handlers = krealloc(syscall_handlers, sizeof(syscall_handler_t)*(num+1));
-        HANDLER_COUNT = num+1;
-        for (int i = 0; i < HANDLER_COUNT; i++) {
-            if (!syscall_handlers[i]) {
-                syscall_handlers[i] = syscall_empty;
-            }
-        }
-    }
-
+    assert(num >= 0 && num < SYSCALL_COUNT);
     syscall_handlers[num] = handler;
 }
 
 void init_syscalls() {
+    for (int i = 0; i < SYSCALL_COUNT; i++) {
+        syscall_handlers[i] = syscall_empty;
+    }
+
     /* Useful */
     register_syscall(0, syscall_read);
     register_syscall(1, syscall_write);
@@ -60,17 +61,47 @@ void init_syscalls() {
     register_syscall(70, syscall_core_count);
     register_syscall(71, syscall_get_core_performance);
     register_syscall(72, syscall_ms_sleep);
+    register_syscall(73, syscall_nice);
+    register_syscall(74, syscall_get_wakeup_stats);
+    register_syscall(75, syscall_futex);
+    register_syscall(76, syscall_sched_setaffinity);
+    register_syscall(77, syscall_sched_getaffinity);
+    register_syscall(78, syscall_sched_setscheduler);
+    register_syscall(79, syscall_sched_getscheduler);
+    register_syscall(80, syscall_spawn);
+    register_syscall(81, syscall_get_thread_stats);
+    register_syscall(82, syscall_getrusage);
+    register_syscall(83, syscall_null);
     register_syscall(300, syscall_set_fs);
 
     /* Memes */
     register_syscall(123, syscall_print_num);
 }
 
-void syscall_handler(syscall_reg_t *r) {
-    if (r->rax < (uint64_t) HANDLER_COUNT) {
+/* Returns 1 if syscall_stub can go back with sysret, 0 for the iretq path. A process
+   that would return to a non canonical RIP is killed first, since sysret and iretq both
+   fault in ring 0 on one, so with no signals yet this only fails if that kill returns. */
+int syscall_handler(syscall_reg_t *r) {
+    account_kernel_entry();
+    percpu_counter_inc(syscall_count);
+    if (r->rax < SYSCALL_COUNT) {
         //sprintf("Handling syscall: %lu\n", r->rax);
         syscall_handlers[r->rax](r);
     }
+    if (r->rcx >= USER_ADDR_END) {
+        /* sysret and iretq both fault in ring 0 on a non canonical RIP, there's nowhere to go back to */
+        kill_process(get_cpu_locals()->current_thread->parent_pid);
+    }
+    if (get_cpu_locals()->need_resched) {
+        force_unlocked_schedule(); // Asked to switch while we were in here, do it before going back
+    }
+    account_kernel_exit();
+    return r->rcx < USER_ADDR_END;
+}
+
+void syscall_null(syscall_reg_t *r) {
+    r->rax = 0;
+    r->rdx = 0;
 }
 
 void syscall_nanosleep(syscall_reg_t *r) {
@@ -158,6 +189,10 @@ void syscall_execve(syscall_reg_t *r) {
     execve((char *) r->rdi, (char **) r->rsi, (char **) r->rdx, r);
 }
 
+void syscall_spawn(syscall_reg_t *r) {
+    r->rax = spawn((char *) r->rdi, (char **) r->rsi, (char **) r->rdx, r);
+}
+
 void syscall_print_num(syscall_reg_t *r) {
     sprintf("PRINTING NUMBER FROM SYSCALL: %lu\n", r->rdi);
     r->rax = 0;
@@ -176,7 +211,7 @@ void syscall_getpid(syscall_reg_t *r) {
 void syscall_getppid(syscall_reg_t *r) {
     (void) r;
     interrupt_safe_lock(sched_lock);
-    process_t *process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
     r->rax = process->ppid;
 }
@@ -242,7 +277,7 @@ void syscall_ipc_wait(syscall_reg_t *r) {
     }
 
     interrupt_safe_lock(sched_lock);
-    process_t *target_process = processes[get_cpu_locals()->current_thread->parent_pid];
+    process_t *target_process = get_process(get_cpu_locals()->current_thread->parent_pid);
     interrupt_safe_unlock(sched_lock);
 
     /* Map IPC buffer into the process */
@@ -310,31 +345,263 @@ void syscall_ms_sleep(syscall_reg_t *r) {
     sleep_ms(r->rdi);
 }
 
-void syscall_futex_wake(syscall_reg_t *r) {
+void syscall_nice(syscall_reg_t *r) {
+    thread_t *thread = get_cpu_locals()->current_thread;
+    if ((int) r->rdi < 0) {
+        interrupt_safe_lock(sched_lock);
+        process_t *process = get_process(thread->parent_pid);
+        int root = process && process->uid == 0;
+        interrupt_safe_unlock(sched_lock);
+        if (!root) {
+            r->rdx = EPERM; // Only root may raise its priority, like real-time in sched_setscheduler
+            return;
+        }
+    }
+    int64_t nice = (int64_t) thread->nice + (int64_t) (int) r->rdi;
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
     r->rdx = 0;
+    r->rax = (uint64_t) (int64_t) set_thread_nice(thread, (int) nice); // Not queued while it's running
+}
 
-    void *futex_phys = virt_to_phys((void *) r->rdi, (pt_t *) get_cpu_locals()->current_thread->regs.cr3);
+void syscall_get_wakeup_stats(syscall_reg_t *r) {
+    if (!range_mapped((void *) r->rdi, sizeof(wakeup_stats_t))) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    r->rdx = 0;
+
+    wakeup_stats_t stats;
+    get_wakeup_stats(&stats);
+    memcpy((uint8_t *) &stats, (uint8_t *) r->rdi, sizeof(wakeup_stats_t));
+}
+
+/* Find the physical address a futex is keyed by, NULL if it's unaligned or unmapped */
+static uint32_t *futex_user_to_phys(uint64_t addr) {
+    if (addr & 3) {
+        return (void *) 0;
+    }
+    void *futex_phys = virt_to_phys((void *) addr, (pt_t *) get_cpu_locals()->current_thread->regs.cr3);
     if ((uint64_t) futex_phys == 0xFFFFFFFFFFFFFFFF) {
+        return (void *) 0;
+    }
+    return futex_phys;
+}
+
+void syscall_futex_wake(syscall_reg_t *r) {
+    uint32_t *futex_phys = futex_user_to_phys(r->rdi);
+    if (!futex_phys) {
         r->rdx = EFAULT;
+        return;
     }
 
-    r->rdx = futex_wake(futex_phys);
+    futex_wake(futex_phys, 1);
+    r->rdx = 0;
 }
 
 void syscall_futex_wait(syscall_reg_t *r) {
+    uint32_t *futex_phys = futex_user_to_phys(r->rdi);
+    if (!futex_phys) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    r->rdx = futex_wait(futex_phys, (uint32_t) r->rsi, 0);
+}
+
+void syscall_futex(syscall_reg_t *r) {
+    uint32_t *futex_phys = futex_user_to_phys(r->rdi);
+    if (!futex_phys) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    uint64_t val = r->rdx; // rdx is where errors go back, so grab the argument first
+    r->rax = 0;
     r->rdx = 0;
+    switch ((int) r->rsi) {
+        case FUTEX_WAIT:
+            r->rdx = futex_wait(futex_phys, (uint32_t) val, r->r10);
+            break;
+        case FUTEX_WAKE:
+            r->rax = futex_wake(futex_phys, (int) val);
+            break;
+        case FUTEX_REQUEUE:
+        case FUTEX_CMP_REQUEUE: {
+            uint32_t *target_phys = futex_user_to_phys(r->r8);
+            if (!target_phys) {
+                r->rdx = EFAULT;
+                break;
+            }
 
-    void *futex_phys = virt_to_phys((void *) r->rdi, (pt_t *) get_cpu_locals()->current_thread->regs.cr3);
-    if ((uint64_t) futex_phys == 0xFFFFFFFFFFFFFFFF) {
+            int done = 0;
+            r->rdx = futex_requeue(futex_phys, (int) val, target_phys, (int) r->r10,
+                r->rsi == FUTEX_CMP_REQUEUE, (uint32_t) r->r9, &done);
+            r->rax = done;
+            break;
+        }
+        case FUTEX_LOCK_PI:
+            r->rdx = futex_lock_pi(futex_phys, r->r10);
+            break;
+        case FUTEX_UNLOCK_PI:
+            r->rdx = futex_unlock_pi(futex_phys);
+            break;
+        default:
+            r->rdx = EINVAL;
+            break;
+    }
+}
+
+/* Find a thread in the caller's process, 0 meaning the caller. Expects sched_lock to be held. */
+static thread_t *sched_target(int64_t tid) {
+    thread_t *current = get_cpu_locals()->current_thread;
+    if (!tid) {
+        return current;
+    }
+    thread_t *thread = get_thread(tid);
+    if (!thread || thread->parent_pid != current->parent_pid) {
+        return (void *) 0;
+    }
+    return thread;
+}
+
+void syscall_sched_setaffinity(syscall_reg_t *r) {
+    uint64_t size = r->rsi;
+    if (size > sizeof(cpumask_t)) {
+        size = sizeof(cpumask_t);
+    }
+    if (!size || !range_mapped((void *) r->rdx, size)) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    cpumask_t mask;
+    cpumask_clear(&mask);
+    memcpy((uint8_t *) r->rdx, (uint8_t *) &mask, size);
+
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_target((int64_t) r->rdi);
+    if (!thread) {
+        r->rdx = ESRCH;
+    } else if (thread->bound) {
+        r->rdx = EINVAL;
+    } else {
+        r->rdx = rq_set_affinity(thread, &mask);
+    }
+    interrupt_safe_unlock(sched_lock);
+}
+
+void syscall_sched_getaffinity(syscall_reg_t *r) {
+    uint64_t size = r->rsi;
+    if (size > sizeof(cpumask_t)) {
+        size = sizeof(cpumask_t);
+    }
+    if (!size || !range_mapped((void *) r->rdx, size)) {
         r->rdx = EFAULT;
+        return;
+    }
+
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_target((int64_t) r->rdi);
+    cpumask_t mask;
+    if (thread) {
+        mask = thread->affinity;
+    }
+    interrupt_safe_unlock(sched_lock);
+
+    if (!thread) {
+        r->rdx = ESRCH;
+        return;
     }
 
-    r->rdx = futex_wait(futex_phys, (uint32_t) r->rsi);
+    cpumask_and_online(&mask);
+    memcpy((uint8_t *) &mask, (uint8_t *) r->rdx, size);
+    r->rdx = 0;
+    r->rax = size;
+}
+
+void syscall_sched_setscheduler(syscall_reg_t *r) {
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_target((int64_t) r->rdi);
+    process_t *process = get_process(get_cpu_locals()->current_thread->parent_pid);
+    if (!thread) {
+        r->rdx = ESRCH;
+    } else if ((int) r->rsi != SCHED_NORMAL && process->uid != 0) {
+        r->rdx = EPERM; // Only root may take real-time priority
+    } else {
+        r->rdx = rq_set_scheduler(thread, (int) r->rsi, (int) r->rdx);
+        futex_pi_reapply(thread); // Keep any boost it's inherited
+    }
+    interrupt_safe_unlock(sched_lock);
+}
+
+void syscall_sched_getscheduler(syscall_reg_t *r) {
+    if (r->rsi && !range_mapped((void *) r->rsi, sizeof(int))) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_target((int64_t) r->rdi);
+    int policy = thread ? thread->base_policy : 0;
+    int priority = thread ? thread->base_rt_priority : 0;
+    interrupt_safe_unlock(sched_lock);
+
+    if (!thread) {
+        r->rdx = ESRCH;
+        return;
+    }
+    if (r->rsi) {
+        memcpy((uint8_t *) &priority, (uint8_t *) r->rsi, sizeof(int));
+    }
+    r->rdx = 0;
+    r->rax = policy;
+}
+
+void syscall_get_thread_stats(syscall_reg_t *r) {
+    if (!range_mapped((void *) r->rsi, sizeof(thread_stats_t))) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    thread_stats_t stats;
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = sched_target((int64_t) r->rdi);
+    if (thread) {
+        stats = thread->stats; // Can tear against its CPU updating it, that's fine for stats
+    }
+    interrupt_safe_unlock(sched_lock);
+
+    if (!thread) {
+        r->rdx = ESRCH;
+        return;
+    }
+    r->rdx = 0;
+    memcpy((uint8_t *) &stats, (uint8_t *) r->rsi, sizeof(thread_stats_t));
+}
+
+void syscall_getrusage(syscall_reg_t *r) {
+    if (!range_mapped((void *) r->rsi, sizeof(rusage_t))) {
+        r->rdx = EFAULT;
+        return;
+    }
+
+    rusage_t usage;
+    int err = get_rusage((int) r->rdi, &usage);
+    r->rdx = err;
+    if (!err) {
+        memcpy((uint8_t *) &usage, (uint8_t *) r->rsi, sizeof(rusage_t));
+    }
 }
 
 void syscall_start_thread(syscall_reg_t *r) {
     thread_t *new_thread = create_thread(get_cpu_locals()->current_thread->name, (void *) r->rdi, r->rsi, 3);
     new_thread->regs.fs = r->rdx;
+    new_thread->affinity = get_cpu_locals()->current_thread->affinity;
     r->rax = add_new_child_thread_no_stack_init(new_thread, get_cpu_locals()->current_thread->parent_pid);
 }
 
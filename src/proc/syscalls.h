@@ -2,6 +2,10 @@
 #define SYSCALLS_H
 #include <stdint.h>
 #include "proc/scheduler.h"
+#include "sys/percpu.h"
+
+#define SYSCALL_COUNT 301 // The dispatch table is fixed size, set_fs (300) is the highest
+#define USER_ADDR_END 0x800000000000 // Userspace ends where the non canonical hole starts
 
 /* All the useful syscalls */
 void syscall_read(syscall_reg_t *r);                  // 0     int fd, void *buf, uint64_t count
@@ -31,6 +35,17 @@ void syscall_exit_thread(syscall_reg_t *r);           // 68
 void syscall_core_count(syscall_reg_t *r);            // 70
 void syscall_get_core_performance(syscall_reg_t *r);  // 71    cpu_performance_t *out, uint8_t core
 void syscall_ms_sleep(syscall_reg_t *r);              // 72    uint64_t ms
+void syscall_nice(syscall_reg_t *r);                  // 73    int increment
+void syscall_get_wakeup_stats(syscall_reg_t *r);      // 74    wakeup_stats_t *out
+void syscall_futex(syscall_reg_t *r);                 // 75    uint32_t *futex, int op, uint32_t val, uint64_t timeout_ns or val2, uint32_t *futex2, uint32_t val3
+void syscall_sched_setaffinity(syscall_reg_t *r);     // 76    int64_t tid, uint64_t size, cpumask_t *mask
+void syscall_sched_getaffinity(syscall_reg_t *r);     // 77    int64_t tid, uint64_t size, cpumask_t *out
+void syscall_sched_setscheduler(syscall_reg_t *r);    // 78    int64_t tid, int policy, int priority
+void syscall_sched_getscheduler(syscall_reg_t *r);    // 79    int64_t tid, int *priority_out
+void syscall_spawn(syscall_reg_t *r);                 // 80    char *path, char **argv, char **envp
+void syscall_get_thread_stats(syscall_reg_t *r);      // 81    int64_t tid, thread_stats_t *out
+void syscall_getrusage(syscall_reg_t *r);             // 82    int who, rusage_t *out
+void syscall_null(syscall_reg_t *r);                  // 83
 void syscall_set_fs(syscall_reg_t *r);                // 300   uint64_t fs
 
 /* Meme syscalls (very temporary) */
@@ -41,6 +56,8 @@ void syscall_empty(syscall_reg_t *r);
 
 void init_syscalls();
 
+DECLARE_PER_CPU_COUNTER(syscall_count);
+
 extern uint64_t memcpy_from_userspace(void *dst, void *src, uint64_t byte_count);
 extern uint64_t strcpy_from_userspace(char *dst, char *src);
 extern uint64_t strlen_from_userspace(char *dst);
@@ -0,0 +1,62 @@
+#include "thread_cache.h"
+#include "sys/percpu.h"
+#include "klibc/stdlib.h"
+#include "klibc/string.h"
+
+DEFINE_PER_CPU(object_cache_t, kernel_stack_cache);
+DEFINE_PER_CPU(object_cache_t, thread_struct_cache);
+
+static void *cache_get(object_cache_t *cache) {
+    return cache->count ? cache->objects[--cache->count] : (void *) 0;
+}
+
+static int cache_put(object_cache_t *cache, void *object) {
+    if (cache->count == THREAD_CACHE_MAX) {
+        return 0;
+    }
+    cache->objects[cache->count++] = object;
+    return 1;
+}
+
+/* Returns the top of a TASK_STACK_SIZE stack. Cached stacks aren't cleared, nothing
+   reads a stack before writing it. */
+uint64_t alloc_kernel_stack() {
+    interrupt_state_t state = interrupt_lock();
+    void *stack = cache_get(this_cpu_ptr(kernel_stack_cache));
+    interrupt_unlock(state);
+    if (!stack) {
+        stack = kmalloc(TASK_STACK_SIZE);
+    }
+    return (uint64_t) stack + TASK_STACK_SIZE;
+}
+
+void free_kernel_stack(uint64_t stack_top) {
+    void *stack = (void *) (stack_top - TASK_STACK_SIZE);
+    interrupt_state_t state = interrupt_lock();
+    int cached = cache_put(this_cpu_ptr(kernel_stack_cache), stack);
+    interrupt_unlock(state);
+    if (!cached) {
+        kfree(stack);
+    }
+}
+
+/* Comes back zeroed, like it would from kcalloc */
+thread_t *alloc_thread_struct() {
+    interrupt_state_t state = interrupt_lock();
+    thread_t *thread = cache_get(this_cpu_ptr(thread_struct_cache));
+    interrupt_unlock(state);
+    if (!thread) {
+        return kcalloc(sizeof(thread_t));
+    }
+    memset((uint8_t *) thread, 0, sizeof(thread_t));
+    return thread;
+}
+
+void free_thread_struct(thread_t *thread) {
+    interrupt_state_t state = interrupt_lock();
+    int cached = cache_put(this_cpu_ptr(thread_struct_cache), thread);
+    interrupt_unlock(state);
+    if (!cached) {
+        kfree(thread);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+
+/* Each CPU keeps a few kernel stacks and thread_t's that were freed, so creating and
+   tearing down threads doesn't have to go to the PMM every time. Stacks come from
+   kmalloc, so they keep its unmapped guard pages the whole time they're cached. */
+#define THREAD_CACHE_MAX 32
+
+typedef struct {
+    void *objects[THREAD_CACHE_MAX];
+    int count;
+} object_cache_t;
+
+uint64_t alloc_kernel_stack();
+void free_kernel_stack(uint64_t stack_top);
+thread_t *alloc_thread_struct();
+void free_thread_struct(thread_t *thread);
+
+#endif
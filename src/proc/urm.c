@@ -1,5 +1,7 @@
 #include "urm.h"
 #include "scheduler.h"
+#include "runqueue.h"
+#include "futex.h"
 #include "exec_formats/elf.h"
 #include "mm/vmm.h"
 #include "mm/pmm.h"
@@ -9,96 +11,185 @@
 #include "drivers/serial.h"
 #include <stddef.h>
 
-urm_type_t urm_type;
-void *urm_data;
-lock_t urm_lock = {0, 0, 0, 0};
-event_t urm_request_event = 0;
-event_t urm_done_event = 0;
-int urm_trigger_done = 1;
-int urm_return = 0;
+/* Dead threads that are off their CPU, freed by this CPU's reap work after a grace period */
+DEFINE_PER_CPU(thread_t *, zombies);
+DEFINE_PER_CPU(work_t, reap_work);
+DEFINE_PER_CPU(uint8_t, reap_queued);
 
-void kill_thread(int64_t tid) {
-    //sprintf("Killing thread\n");
-    interrupt_safe_lock(sched_lock);
-    thread_t *thread = threads[tid];
-    thread->state = BLOCKED;
-    //sprintf("Blocked thread\n");
+static void dead_mm_teardown(work_t *work) {
+    dead_mm_t *mm = (dead_mm_t *) work;
+    vmm_deconstruct_address_space(mm->cr3);
+    kfree(mm);
+}
 
-    if (thread->cpu != -1) {
-        uint8_t cpu = (uint8_t) thread->cpu;
-        interrupt_safe_unlock(sched_lock);
-        //sprintf("Rescheduling CPU\n");
-        send_ipi(cpu, (1 << 14) | 253); // Reschedule, in case the cpu is still running the thread
-        //sprintf("Sent IPI, waiting...\n");
-        while (thread->cpu != -1) { asm("pause"); }
-        //sprintf("Done waiting\n");
-        interrupt_safe_lock(sched_lock);
+/* Takes the caller's reference, put it once every thread is killed */
+static dead_mm_t *new_dead_mm(process_t *process) {
+    if (process->cr3 == base_kernel_cr3) {
+        return (void *) 0; // Kernel processes share the kernel's tables
+    }
+    dead_mm_t *mm = kcalloc(sizeof(dead_mm_t));
+    mm->refs = 1;
+    mm->cr3 = (void *) process->cr3;
+    mm->size_hint = process->current_brk - 0x10000000000;
+    return mm;
+}
+
+static void put_dead_mm(dead_mm_t *mm) {
+    if (!mm || __atomic_sub_fetch(&mm->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    if (mm->size_hint >= ASYNC_TEARDOWN_SIZE) {
+        init_work(&mm->work, dead_mm_teardown);
+        mm->work.detached = 1;
+        queue_work(&mm->work);
+    } else {
+        dead_mm_teardown(&mm->work);
+    }
+}
+
+static void reap_zombies(work_t *work) {
+    (void) work;
+    interrupt_state_t state = interrupt_lock();
+    *this_cpu_ptr(reap_queued) = 0;
+    thread_t *thread = *this_cpu_ptr(zombies);
+    *this_cpu_ptr(zombies) = (void *) 0;
+    interrupt_unlock(state);
+
+    /* Wakers and timers on other CPUs may have grabbed a pointer before it died */
+    sched_synchronize();
+    while (thread) {
+        thread_t *next = thread->zombie_next;
+        dead_mm_t *mm = thread->dead_mm;
+        destroy_thread(thread);
+        put_dead_mm(mm);
+        thread = next;
+    }
+}
+
+/* Hand a dying thread that's off its CPU over to be freed. Whoever sees it like that
+   first gets it, the kill or the CPU it was running on. */
+void reap_thread(thread_t *thread) {
+    if (__atomic_exchange_n(&thread->reaped, 1, __ATOMIC_SEQ_CST)) {
+        return;
     }
-    //sprintf("Removing threads.\n");
 
-    /* TODO: do proper cleanup */
-    if (!threads[tid]) {
-        //sprintf("thread is null\n");
+    interrupt_state_t state = interrupt_lock();
+    thread->zombie_next = *this_cpu_ptr(zombies);
+    *this_cpu_ptr(zombies) = thread;
+    if (!*this_cpu_ptr(reap_queued)) {
+        *this_cpu_ptr(reap_queued) = 1;
+        work_t *work = this_cpu_ptr(reap_work);
+        if (!work->func) {
+            init_work(work, reap_zombies);
+            work->detached = 1;
+        }
+        queue_work(work); // Runs on this CPU, so it sees the same zombie list
+    }
+    interrupt_unlock(state);
+}
+
+/* Mark a thread dead and pull it off everything it's on, without waiting for it to
+   stop. If it's running its CPU drops it at the next reschedule. Expects sched_lock. */
+static void kill_thread_locked(thread_t *thread, dead_mm_t *mm) {
+    process_t *process = get_process(thread->parent_pid);
+    if (process) { // Whatever it runs from here on isn't counted
+        process->dead_utime_tsc += thread->utime_tsc;
+        process->dead_stime_tsc += thread->stime_tsc;
+        process->dead_voluntary_switches += thread->stats.voluntary_switches;
+        process->dead_involuntary_switches += thread->stats.involuntary_switches;
     }
-    //sprintf("thread = %lx\n", threads[tid]);
-    kfree(threads[tid]);
-    threads[tid] = (void *) 0;
-    //sprintf("Removed threads.\n");s
+    if (mm) {
+        __atomic_add_fetch(&mm->refs, 1, __ATOMIC_RELAXED);
+        thread->dead_mm = mm;
+    }
+    thread->state = BLOCKED;
+    __atomic_store_n(&thread->dying, 1, __ATOMIC_SEQ_CST);
+    idr_remove(&thread_ids, thread->tid);
+
+    rq_dequeue(thread);
+    ktimer_cancel(&thread->sleep_timer);
+    abort_wait(thread);
+    ktimer_cancel(&thread->timeout_timer);
+    futex_exit_thread(thread);
+
+    int cpu = thread->cpu;
+    if (cpu == -1) {
+        reap_thread(thread);
+    } else {
+        resched_cpu(cpu);
+    }
+}
 
+void kill_thread(int64_t tid) {
+    interrupt_safe_lock(sched_lock);
+    thread_t *thread = get_thread(tid);
+    if (thread) { // Killed already otherwise, it's out of the IDR as soon as it's dying
+        kill_thread_locked(thread, (void *) 0);
+    }
     interrupt_safe_unlock(sched_lock);
-    //sprintf("Returning.\n");
 }
 
-void urm_kill_thread(urm_kill_thread_data *data) {
-    int64_t tid_to_kill = data->tid;
-    kill_thread(tid_to_kill);
-    urm_return = 0;
+void urm_kill_thread(work_t *work) {
+    urm_kill_thread_data *data = (urm_kill_thread_data *) work;
+    kill_thread(data->tid);
 }
 
-void urm_kill_process(urm_kill_process_data *data) {
+static void kill_process_now(int64_t pid) {
     interrupt_safe_lock(sched_lock);
-    process_t *process = processes[data->pid];
+    process_t *process = idr_remove(&process_ids, pid);
+    if (!process) {
+        interrupt_safe_unlock(sched_lock);
+        return; // Someone else is killing it
+    }
 
-    uint64_t size = process->threads_size;
-    int64_t *tids = kmalloc(sizeof(int64_t) * process->threads_size);
+    /* Every CPU drops its own threads, nothing here waits on them. The last one to be
+       freed takes the address space with it. */
+    dead_mm_t *mm = new_dead_mm(process);
     for (uint64_t i = 0; i < process->threads_size; i++) {
-        tids[i] = process->threads[i];
+        int64_t tid = process->threads[i];
+        thread_t *thread = tid ? get_thread(tid) : (void *) 0;
+        if (thread) {
+            kill_thread_locked(thread, mm);
+        }
     }
     interrupt_safe_unlock(sched_lock);
+    put_dead_mm(mm);
+    kfree(process);
+}
 
-    for (uint64_t i = 0; i < size; i++) {
-        if (tids[i]) {
-            kill_thread(tids[i]);
-        }
+void urm_kill_process(work_t *work) {
+    urm_kill_process_data *data = (urm_kill_process_data *) work;
+    uint8_t heap = data->heap; // data may be on the victim's stack, gone once it's killed
+    kill_process_now(data->pid);
+    if (heap) {
+        kfree(data);
     }
-
-    interrupt_safe_lock(sched_lock);
-    kfree(processes[data->pid]);
-    processes[data->pid] = (void *) 0;
-    interrupt_safe_unlock(sched_lock);
-    urm_return = 0;
 }
 
-void urm_execve(urm_execve_data *data) {
+void urm_execve(work_t *work) {
+    urm_execve_data *data = (urm_execve_data *) work;
     uint64_t entry_point = 0;
     auxv_auxc_group_t auxv_info;
     void *address_space = load_elf_addrspace(data->executable_path, &entry_point, 0, NULL, &auxv_info);
     if (!address_space) {
         sprintf("bruh momento [execve]\n");
-        urm_return = ENOENT;
+        data->ret = ENOENT;
+        complete_work(work);
         return;
     }
 
     interrupt_safe_lock(sched_lock);
-    process_t *current_process = processes[data->pid];
-    for (uint64_t i = 0; i < current_process->threads_size; i++) {
-        kfree(threads[current_process->threads[i]]);
-        threads[current_process->threads[i]] = (void *) 0;
+    process_t *current_process = get_process(data->pid);
+    if (!current_process) {
+        interrupt_safe_unlock(sched_lock);
+        vmm_deconstruct_address_space(address_space);
+        data->ret = ESRCH; // Killed while we were loading
+        complete_work(work);
+        return;
     }
-    vmm_deconstruct_address_space((void *) current_process->cr3);
-    current_process->current_brk = 0x10000000000;
 
-    current_process->cr3 = (uint64_t) address_space;
+    /* The request lives on the stack of a thread we're about to kill */
+    int64_t pid = data->pid;
     thread_t *thread = create_thread(data->executable_path, (void *) entry_point, USER_STACK, 3);
     if (auxv_info.auxv) {
         thread->vars.auxc = auxv_info.auxc;
@@ -109,59 +200,21 @@ void urm_execve(urm_execve_data *data) {
     thread->vars.enviroment = data->envp;
     thread->vars.argv = data->argv;
 
-    interrupt_safe_unlock(sched_lock);
-
-    add_new_child_thread(thread, data->pid);
-    urm_return = 0;
-    urm_trigger_done = 0;
-}
-
-/* Epic */
-void urm_thread() {
-    while (1) {
-        await_event(&urm_request_event); // Wait for a URM request
-        switch (urm_type) {
-            case URM_KILL_PROCESS:
-                urm_kill_process(urm_data);
-                break;
-            case URM_KILL_THREAD:
-                urm_kill_thread(urm_data);
-                break;
-            case URM_EXECVE:
-                urm_execve(urm_data);
-                break;
-            default:
-                break;
-        }
-        if (urm_trigger_done) {
-            trigger_event(&urm_done_event);
+    /* The old address space goes once none of its threads can be on a CPU */
+    dead_mm_t *mm = new_dead_mm(current_process);
+    for (uint64_t i = 0; i < current_process->threads_size; i++) {
+        int64_t tid = current_process->threads[i];
+        thread_t *old_thread = tid ? get_thread(tid) : (void *) 0;
+        if (old_thread) {
+            kill_thread_locked(old_thread, mm);
         }
-        unlock(urm_lock);
     }
-}
-
-int send_urm_request(void *data, urm_type_t type) {
-    lock(urm_lock);
-    urm_trigger_done = 1;
-    urm_data = data;
-    urm_type = type;
-    trigger_event(&urm_request_event);
-    await_event(&urm_done_event);
-    return urm_return;
-}
+    current_process->cr3 = (uint64_t) address_space;
+    current_process->current_brk = 0x10000000000;
+    interrupt_safe_unlock(sched_lock);
+    put_dead_mm(mm);
 
-void send_urm_request_isr(void *data, urm_type_t type) {
-    lock(urm_lock);
-    urm_trigger_done = 0;
-    urm_data = data;
-    urm_type = type;
-    trigger_event(&urm_request_event);
+    if (add_new_child_thread(thread, pid) == -1) {
+        destroy_thread(thread); // Killed just now, that took the new address space too
+    }
 }
-
-void send_urm_request_async(void *data, urm_type_t type) {
-    lock(urm_lock);
-    urm_trigger_done = 0;
-    urm_data = data;
-    urm_type = type;
-    trigger_event(&urm_request_event);
-}
\ No newline at end of file
@@ -1,24 +1,23 @@
 #ifndef URM_H
 #define URM_H
 #include <stdint.h>
-#include "event.h"
-#include "klibc/lock.h"
-
-typedef enum {
-    URM_KILL_PROCESS,
-    URM_KILL_THREAD,
-    URM_EXECVE,
-} urm_type_t;
+#include "workqueue.h"
 
+/* Requests are queued as work, the work_t is first so the worker hands us the request */
 typedef struct {
+    work_t work;
     int64_t pid;
+    uint8_t heap; // kfree'd once it's done, nobody is around to wait on it
 } urm_kill_process_data;
 
 typedef struct {
+    work_t work;
     int64_t tid;
 } urm_kill_thread_data;
 
 typedef struct {
+    work_t work;
+    int ret;
     char **argv;
     char **envp;
     int envc;
@@ -28,11 +27,23 @@ typedef struct {
     int64_t tid;
 } urm_execve_data;
 
-void urm_thread();
-int send_urm_request(void *data, urm_type_t type);
-void send_urm_request_isr(void *data, urm_type_t type);
-void send_urm_request_async(void *data, urm_type_t type);
+/* Address spaces at least this big (by heap size) get a work item of their own to
+   be torn down in, instead of holding up the reaper */
+#define ASYNC_TEARDOWN_SIZE (64 * 1024 * 1024)
+
+/* An address space whose threads are dying, torn down once the last one is freed */
+typedef struct dead_mm {
+    work_t work;
+    int refs;
+    void *cr3;
+    uint64_t size_hint;
+} dead_mm_t;
+
+void urm_kill_process(work_t *work);
+void urm_kill_thread(work_t *work);
+void urm_execve(work_t *work);
 
 void kill_thread(int64_t tid);
+void reap_thread(thread_t *thread);
 
 #endif
\ No newline at end of file
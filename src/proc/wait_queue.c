@@ -0,0 +1,132 @@
+#include "wait_queue.h"
+#include "runqueue.h"
+#include "sys/smp.h"
+#include "sys/ktimer.h"
+#include "klibc/stdlib.h"
+
+/* Add a thread to the back of a queue, expects the queue lock to be held */
+void wait_queue_add_locked(wait_queue_t *wq, thread_t *thread) {
+    thread->wq_next = (void *) 0;
+    thread->wq_prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->wq_next = thread;
+    } else {
+        wq->head = thread;
+    }
+    wq->tail = thread;
+    thread->wait_queue = wq;
+}
+
+void wait_queue_remove_locked(wait_queue_t *wq, thread_t *thread) {
+    if (thread->wq_prev) {
+        thread->wq_prev->wq_next = thread->wq_next;
+    } else {
+        wq->head = thread->wq_next;
+    }
+    if (thread->wq_next) {
+        thread->wq_next->wq_prev = thread->wq_prev;
+    } else {
+        wq->tail = thread->wq_prev;
+    }
+    thread->wq_next = (void *) 0;
+    thread->wq_prev = (void *) 0;
+    thread->wait_queue = (void *) 0;
+}
+
+/* Get on the queue and mark ourselves waiting, expects interrupts to be off */
+void prepare_to_wait(wait_queue_t *wq) {
+    thread_t *thread = get_cpu_locals()->current_thread;
+
+    lock(wq->lock);
+    if (thread->wait_queue != wq) {
+        wait_queue_add_locked(wq, thread);
+    }
+    thread->state = WAITING;
+    unlock(wq->lock);
+}
+
+/* Get off the queue after waking, or after finding we didn't need to wait */
+void finish_wait(wait_queue_t *wq) {
+    thread_t *thread = get_cpu_locals()->current_thread;
+
+    uint8_t expected = WAITING;
+    if (!__atomic_compare_exchange_n(&thread->state, &expected, RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+        && expected == READY) {
+        /* Someone woke us before we went to sleep. We're still running so they left
+           queueing us to finish_switch, take that back once they've posted it. */
+        while (!__atomic_exchange_n(&thread->wake_pending, 0, __ATOMIC_ACQ_REL) && !thread->dying) {
+            asm volatile("pause");
+        }
+        thread->wake_tsc = 0;
+        thread->ready_tsc = 0;
+        thread->state = RUNNING;
+    }
+
+    (void) wq;
+    abort_wait(thread); // We may have been moved to another queue while we slept
+}
+
+/* Sleep until woken or until the deadline (ns since boot) passes. Returns 1 if we timed out. */
+int schedule_timeout(uint64_t deadline) {
+    thread_t *thread = get_cpu_locals()->current_thread;
+    thread->timed_out = 0;
+    ktimer_start(&thread->timeout_timer, deadline);
+    force_unlocked_schedule();
+    ktimer_cancel(&thread->timeout_timer);
+    return thread->timed_out;
+}
+
+void timeout_timer_expired(ktimer_t *timer) {
+    thread_t *thread = container_of(timer, thread_t, timeout_timer);
+    thread->timed_out = 1;
+    try_wake_thread(thread, WAITING);
+}
+
+/* Pull a thread off whatever queue it's waiting on */
+void abort_wait(thread_t *thread) {
+    interrupt_state_t state = interrupt_lock();
+    while (1) {
+        wait_queue_t *wq = thread->wait_queue;
+        if (!wq) {
+            break;
+        }
+
+        lock(wq->lock);
+        if (thread->wait_queue == wq) {
+            wait_queue_remove_locked(wq, thread);
+            unlock(wq->lock);
+            break;
+        }
+        unlock(wq->lock); // Woken under us, try again
+    }
+    interrupt_unlock(state);
+}
+
+/* Wake the longest waiting thread, returns how many threads were woken */
+int wake_one(wait_queue_t *wq) {
+    int woken = 0;
+    interrupt_state_t state = interrupt_lock();
+    lock(wq->lock);
+    while (wq->head && !woken) {
+        thread_t *thread = wq->head;
+        wait_queue_remove_locked(wq, thread);
+        woken = try_wake_thread(thread, WAITING);
+    }
+    unlock(wq->lock);
+    interrupt_unlock(state);
+    return woken;
+}
+
+int wake_all(wait_queue_t *wq) {
+    int woken = 0;
+    interrupt_state_t state = interrupt_lock();
+    lock(wq->lock);
+    while (wq->head) {
+        thread_t *thread = wq->head;
+        wait_queue_remove_locked(wq, thread);
+        woken += try_wake_thread(thread, WAITING);
+    }
+    unlock(wq->lock);
+    interrupt_unlock(state);
+    return woken;
+}
@@ -0,0 +1,33 @@
+#ifndef WAIT_QUEUE_H
+#define WAIT_QUEUE_H
+#include <stdint.h>
+#include "proc/scheduler.h"
+#include "klibc/lock.h"
+
+/* FIFO of threads blocked on something. Threads link in through their own
+   thread_t, so a thread can only wait on one queue at a time. */
+typedef struct wait_queue {
+    lock_t lock;
+    thread_t *head;
+    thread_t *tail;
+} wait_queue_t;
+
+/* Waiting goes like this, with interrupts off the whole time:
+       prepare_to_wait(wq);
+       if (!condition) schedule_timeout(...) or force_unlocked_schedule();
+       finish_wait(wq);
+   and loop if the condition still isn't true. */
+void prepare_to_wait(wait_queue_t *wq);
+void finish_wait(wait_queue_t *wq);
+int schedule_timeout(uint64_t deadline);
+void abort_wait(thread_t *thread);
+
+void wait_queue_add_locked(wait_queue_t *wq, thread_t *thread);
+void wait_queue_remove_locked(wait_queue_t *wq, thread_t *thread);
+
+int wake_one(wait_queue_t *wq);
+int wake_all(wait_queue_t *wq);
+
+void timeout_timer_expired(ktimer_t *timer);
+
+#endif
@@ -0,0 +1,80 @@
+#include "workqueue.h"
+#include "proc/scheduler.h"
+#include "sys/cpu_index.h"
+#include "klibc/string.h"
+#include "drivers/serial.h"
+
+DEFINE_PER_CPU(workqueue_t, workqueues);
+
+static void worker_thread() {
+    /* Workers are bound, so this is the same queue for as long as we run */
+    workqueue_t *wq = this_cpu_ptr(workqueues);
+    while (1) {
+        await_event(&wq->pending);
+
+        interrupt_state_t state = interrupt_lock();
+        lock(wq->lock);
+        work_t *work = wq->head;
+        wq->head = work->next;
+        if (!wq->head) {
+            wq->tail = (void *) 0;
+        }
+        unlock(wq->lock);
+        interrupt_unlock(state);
+
+        int detached = work->detached;
+        work->func(work);
+        if (!detached) {
+            trigger_event(&work->done);
+        }
+    }
+}
+
+/* Start the workers for every CPU that's up, needs PID 0 to exist */
+void workqueue_init() {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!percpu_offsets[cpu]) {
+            continue;
+        }
+        for (int i = 0; i < WORKERS_PER_CPU; i++) {
+            thread_t *worker = create_bound_kthread("Worker", worker_thread, cpu);
+            /* Left in the fair class, exec and big teardowns would starve the CPU otherwise */
+            add_new_child_thread(worker, 0);
+        }
+    }
+    sprintf("[Workqueue] Started %d workers per CPU\n", WORKERS_PER_CPU);
+}
+
+void init_work(work_t *work, void (*func)(work_t *work)) {
+    memset((uint8_t *) work, 0, sizeof(work_t));
+    work->func = func;
+}
+
+void queue_work_on(int cpu, work_t *work) {
+    workqueue_t *wq = per_cpu_ptr(workqueues, cpu);
+    work->next = (void *) 0;
+
+    interrupt_state_t state = interrupt_lock();
+    lock(wq->lock);
+    if (wq->tail) {
+        wq->tail->next = work;
+    } else {
+        wq->head = work;
+    }
+    wq->tail = work;
+    unlock(wq->lock);
+    trigger_event(&wq->pending);
+    interrupt_unlock(state);
+}
+
+/* Queue on the CPU we're running on, so the work stays cache local */
+void queue_work(work_t *work) {
+    interrupt_state_t state = interrupt_lock();
+    queue_work_on(get_cpu_index(), work);
+    interrupt_unlock(state);
+}
+
+/* Wait for queued work to finish */
+void flush_work(work_t *work) {
+    await_event(&work->done);
+}
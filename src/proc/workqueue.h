@@ -0,0 +1,39 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+#include <stdint.h>
+#include "proc/event.h"
+#include "klibc/lock.h"
+#include "sys/percpu.h"
+
+/* Every CPU has a queue of deferred kernel work and a few worker threads bound to it
+   to run it, so one item that blocks doesn't hold up the rest */
+#define WORKERS_PER_CPU 2
+
+typedef struct work {
+    void (*func)(struct work *work);
+    struct work *next;
+    event_t done; // Triggered once func returns, for flush_work
+    int detached; // Set before queueing if the work may be gone once func returns, the worker leaves done alone
+} work_t;
+
+typedef struct {
+    lock_t lock;
+    work_t *head;
+    work_t *tail;
+    event_t pending; // One trigger for every queued item
+} workqueue_t;
+
+DECLARE_PER_CPU(workqueue_t, workqueues);
+
+void workqueue_init();
+void init_work(work_t *work, void (*func)(work_t *work));
+void queue_work(work_t *work);
+void queue_work_on(int cpu, work_t *work);
+void flush_work(work_t *work);
+
+/* Detached work that does have someone waiting lets them go itself, while it still can */
+static inline void complete_work(work_t *work) {
+    trigger_event(&work->done);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef CPUMASK_H
+#define CPUMASK_H
+#include <stdint.h>
+#include "sys/percpu.h"
+
+/* A bit for every CPU index */
+typedef struct {
+    uint64_t bits[MAX_CPUS / 64];
+} cpumask_t;
+
+static inline void cpumask_clear(cpumask_t *mask) {
+    for (int i = 0; i < MAX_CPUS / 64; i++) {
+        mask->bits[i] = 0;
+    }
+}
+
+static inline void cpumask_setall(cpumask_t *mask) {
+    for (int i = 0; i < MAX_CPUS / 64; i++) {
+        mask->bits[i] = ~(uint64_t) 0;
+    }
+}
+
+static inline void cpumask_set_cpu(cpumask_t *mask, int cpu) {
+    mask->bits[cpu / 64] |= (uint64_t) 1 << (cpu % 64);
+}
+
+static inline int cpumask_test_cpu(const cpumask_t *mask, int cpu) {
+    return (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/* Keep only the CPUs that are up, returns 0 if none are left */
+static inline int cpumask_and_online(cpumask_t *mask) {
+    int any = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!percpu_offsets[i]) {
+            mask->bits[i / 64] &= ~((uint64_t) 1 << (i % 64));
+        } else if (cpumask_test_cpu(mask, i)) {
+            any = 1;
+        }
+    }
+    return any;
+}
+
+#endif
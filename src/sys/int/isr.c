@@ -3,6 +3,7 @@
 #include "proc/scheduler.h"
 #include "proc/urm.h"
 #include "proc/mxcsr.h"
+#include "proc/fpu.h"
 #include "drivers/tty/tty.h"
 #include "drivers/serial.h"
 #include "drivers/pit.h"
@@ -14,9 +15,13 @@
 #include "mm/vmm.h"
 
 #include "sys/smp.h"
+#include "sys/percpu.h"
+#include "sys/lapic_timer.h"
 
 int_handler_t handlers[IDT_ENTRIES];
 
+DEFINE_PER_CPU_COUNTER(irq_count);
+
 void register_int_handler(uint8_t n, int_handler_t handler) {
     handlers[n] = handler;
 }
@@ -33,7 +38,7 @@ static void send_panic_ipis() {
 void isr_handler(int_reg_t *r) {
     uint64_t start_tsc = read_tsc();
     uint8_t was_idle = 0;
-    if (r->int_num != 32 && r->int_num != 253 && r->int_num != 254) {
+    if (r->int_num != 32 && r->int_num != LAPIC_TIMER_VECTOR && r->int_num != 253 && r->int_num != 254) {
         if (get_cpu_locals()->currently_idle) {
             get_cpu_locals()->idle_tsc_count += read_tsc() - get_cpu_locals()->idle_start_tsc;
             get_cpu_locals()->currently_idle = 0;
@@ -43,11 +48,20 @@ void isr_handler(int_reg_t *r) {
         }
     }
 
+    if (r->int_num >= 32) {
+        this_cpu_ptr(irq_count)->count++; // Interrupts are off, no need to guard the increment
+    }
+    if (r->cs & 3) {
+        account_kernel_entry();
+    }
+
     /* If the int number is in range */
     if (r->int_num < IDT_ENTRIES) {
-        if (r->int_num < 32) {
+        if (r->int_num == 7 && fpu_device_not_available()) {
+            /* Lazy FPU switch, the thread carries on where it was */
+        } else if (r->int_num < 32) {
             vmm_set_pml4t(base_kernel_cr3); // Use base kernel CR3 in case the alternate CR3 is corrupted
-            if (r->cs != 0x1B) {
+            if (r->cs != 0x23) {
                 /* Exception */
                 uint64_t cr2;
                 asm volatile("movq %%cr2, %0;" : "=r"(cr2));
@@ -84,38 +98,16 @@ void isr_handler(int_reg_t *r) {
                     sprintf("mxcsr: %lx\n", mxcsr_val);
                 }
 
-                if (get_cpu_locals()->current_thread->parent_pid) {
-                    //sprintf("Killed process %ld\n", get_cpu_locals()->current_thread->parent_pid);
-                    interrupt_safe_lock(sched_lock);
-                    thread_t *thread = threads[get_cpu_locals()->current_thread->tid];
+                thread_t *thread = get_cpu_locals()->current_thread;
+                if (thread->parent_pid) {
+                    /* Never runs again, the kill reaps it once schedule takes it off this CPU */
                     thread->state = BLOCKED;
-                    thread->cpu = -1;
-                    sprintf("tid = %ld\n", thread->tid);
-                    process_t *process = processes[get_cpu_locals()->current_thread->parent_pid];
-                    sprintf("killing process %ld with struct address %lx from ISR\n", get_cpu_locals()->current_thread->parent_pid, process);
-
-                    uint64_t size = process->threads_size;
-                    int64_t *tids = kmalloc(sizeof(int64_t) * process->threads_size);
-                    for (uint64_t i = 0; i < process->threads_size; i++) {
-                        tids[i] = process->threads[i];
-                    }
-                    interrupt_safe_unlock(sched_lock);
-
-                    for (uint64_t i = 0; i < size; i++) {
-                        if (tids[i]) {
-                            kill_thread(tids[i]);
-                        }
-                    }
-
-                    interrupt_safe_lock(sched_lock);
-                    kfree(processes[get_cpu_locals()->current_thread->parent_pid]);
-                    processes[get_cpu_locals()->current_thread->parent_pid] = (void *) 0;
-                    interrupt_safe_unlock(sched_lock);
+                    sprintf("killing process %ld from ISR\n", thread->parent_pid);
+                    kill_process_async(thread->parent_pid);
                 } else {
-                    kill_thread(get_cpu_locals()->current_thread->tid);
+                    kill_thread(thread->tid);
                 }
                 sprintf("Thread is dead\n");
-                get_cpu_locals()->current_thread = (thread_t *) 0;
                 schedule(r); // Schedule for this CPU
             }
         }
@@ -132,7 +124,7 @@ void isr_handler(int_reg_t *r) {
         while (1) { asm volatile("hlt"); }
     }
 
-    if (r->int_num != 32 && r->int_num != 253 && r->int_num != 254) {
+    if (r->int_num != 32 && r->int_num != LAPIC_TIMER_VECTOR && r->int_num != 253 && r->int_num != 254) {
         get_cpu_locals()->active_tsc_count += read_tsc() - start_tsc;
         if (was_idle) {
             get_cpu_locals()->idle_start_tsc = read_tsc();
@@ -142,6 +134,10 @@ void isr_handler(int_reg_t *r) {
         }
     }
 
+    if (r->cs & 3) {
+        account_kernel_exit(); // Might be another thread than came in, if we switched
+    }
+
     // If we make it here, send an EOI to our LAPIC
     write_lapic(0xB0, 0);
 }
@@ -474,13 +470,15 @@ void configure_idt() {
     set_ist(33, 1);
     set_ist(254, 1);
     set_ist(253, 1);
+    set_ist(LAPIC_TIMER_VECTOR, 1); // Preempts through schedule(), so it can't be on the thread's stack
 
     load_idt(); // Point to the IDT
     register_int_handler(32, timer_handler);
     register_int_handler(33, keyboard_handler);
     register_int_handler(44, mouse_handler);
     register_int_handler(254, schedule);
-    register_int_handler(253, schedule_ap);
+    register_int_handler(253, schedule_tick);
+    register_int_handler(LAPIC_TIMER_VECTOR, lapic_timer_handler);
     register_int_handler(252, isr_panic_idle);
     register_int_handler(251, panic_handler);
     asm volatile("sti"); // Enable interrupts and hope we dont die lmao
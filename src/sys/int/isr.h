@@ -1,6 +1,7 @@
 #ifndef ISR_H
 #define ISR_H
 #include <stdint.h>
+#include "sys/percpu.h"
 
 /* Interrupt register struct */
 typedef struct {
@@ -14,6 +15,8 @@ typedef void (*int_handler_t) (int_reg_t *);
 void register_int_handler(uint8_t n, int_handler_t handler);
 void configure_idt();
 
+DECLARE_PER_CPU_COUNTER(irq_count);
+
 extern void isr0();
 extern void isr1();
 extern void isr2();
@@ -0,0 +1,232 @@
+#include "ktimer.h"
+#include "lapic_timer.h"
+#include "timekeeping.h"
+#include "sys/smp.h"
+
+DEFINE_PER_CPU(ktimer_base_t, ktimer_base);
+
+static inline uint64_t ns_to_jiffy(uint64_t ns) {
+    return (ns >> KTIMER_SHIFT) + ((ns & ((1ULL << KTIMER_SHIFT) - 1)) != 0); // Round up, never fire early
+}
+
+/* Put a timer in the slot for its expiry, relative to where the wheel is now */
+static void wheel_add(ktimer_base_t *base, ktimer_t *timer) {
+    uint64_t jiffy = timer->jiffy;
+    if (jiffy < base->clk) {
+        jiffy = base->clk; // Already expired, run it as soon as possible
+    }
+    uint64_t delta = jiffy - base->clk;
+    if (delta > KTIMER_MAX_DELTA) {
+        delta = KTIMER_MAX_DELTA; // Too far out, gets put back when it comes around
+        jiffy = base->clk + delta;
+    }
+
+    int level = 0;
+    while (level < KTIMER_LEVELS - 1 && delta >= (1ULL << ((level + 1) * KTIMER_WHEEL_BITS))) {
+        level++;
+    }
+    int index = (jiffy >> (level * KTIMER_WHEEL_BITS)) & KTIMER_WHEEL_MASK;
+
+    ktimer_t **head = &base->slots[level][index];
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+    timer->slot = level * KTIMER_WHEEL_SIZE + index;
+    base->pending[level] |= 1ULL << index;
+}
+
+static void wheel_remove(ktimer_base_t *base, ktimer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+
+    int level = timer->slot / KTIMER_WHEEL_SIZE;
+    int index = timer->slot % KTIMER_WHEEL_SIZE;
+    if (!base->slots[level][index]) {
+        base->pending[level] &= ~(1ULL << index);
+    }
+    timer->next = (void *) 0;
+    timer->pprev = (void *) 0;
+}
+
+/* The next jiffy the wheel has something to do at, either running a level 0 slot or
+   cascading a higher one. UINT64_MAX if the wheel is empty. */
+static uint64_t wheel_next_event(ktimer_base_t *base) {
+    uint64_t next = 0xFFFFFFFFFFFFFFFF;
+    for (int level = 0; level < KTIMER_LEVELS; level++) {
+        uint64_t pending = base->pending[level];
+        if (!pending) {
+            continue;
+        }
+
+        /* Slots are visited in order starting from the next boundary of this level */
+        int shift = level * KTIMER_WHEEL_BITS;
+        uint64_t boundary = (base->clk + (1ULL << shift) - 1) >> shift;
+        int rot = boundary & KTIMER_WHEEL_MASK;
+        pending = (pending >> rot) | (pending << ((KTIMER_WHEEL_SIZE - rot) & KTIMER_WHEEL_MASK));
+
+        uint64_t jiffy = (boundary + __builtin_ctzll(pending)) << shift;
+        if (jiffy < next) {
+            next = jiffy;
+        }
+    }
+    return next;
+}
+
+/* Move the slots that come due at this jiffy down the wheel */
+static void wheel_cascade(ktimer_base_t *base, uint64_t jiffy) {
+    for (int level = 1; level < KTIMER_LEVELS; level++) {
+        int shift = level * KTIMER_WHEEL_BITS;
+        if (jiffy & ((1ULL << shift) - 1)) {
+            break; // The level below hasn't wrapped
+        }
+
+        int index = (jiffy >> shift) & KTIMER_WHEEL_MASK;
+        ktimer_t *timer = base->slots[level][index];
+        base->slots[level][index] = (void *) 0;
+        base->pending[level] &= ~(1ULL << index);
+        while (timer) {
+            ktimer_t *next = timer->next;
+            wheel_add(base, timer);
+            timer = next;
+        }
+    }
+}
+
+/* Catch an idle wheel up to the present without walking every jiffy it slept through */
+static void wheel_forward(ktimer_base_t *base, uint64_t now) {
+    if (now <= base->clk) {
+        return;
+    }
+    uint64_t next = wheel_next_event(base);
+    base->clk = next < now ? next : now;
+}
+
+void ktimer_init(ktimer_t *timer, void (*callback)(ktimer_t *timer)) {
+    timer->callback = callback;
+    timer->expires = 0;
+    timer->next = (void *) 0;
+    timer->pprev = (void *) 0;
+    timer->cpu = -1;
+    timer->last_cpu = -1;
+}
+
+/* Take a timer off its base, returns 1 if it was queued */
+static int ktimer_dequeue(ktimer_t *timer) {
+    while (1) {
+        int cpu = timer->cpu;
+        if (cpu == -1) {
+            return 0;
+        }
+
+        ktimer_base_t *base = per_cpu_ptr(ktimer_base, cpu);
+        lock(base->lock);
+        if (timer->cpu == cpu) {
+            wheel_remove(base, timer);
+            timer->cpu = -1;
+            unlock(base->lock);
+            return 1;
+        }
+        unlock(base->lock); // Moved under us, try again
+    }
+}
+
+/* Queue a timer on this CPU, restarting it if it was already queued */
+void ktimer_start(ktimer_t *timer, uint64_t expires) {
+    interrupt_state_t state = interrupt_lock();
+    ktimer_dequeue(timer);
+
+    /* CPUs without a working LAPIC timer leave their timers to the BSP's PIT */
+    int cpu = lapic_timer_enabled() ? get_cpu_index() : 0;
+    ktimer_base_t *base = per_cpu_ptr(ktimer_base, cpu);
+
+    lock(base->lock);
+    wheel_forward(base, get_time_ns() >> KTIMER_SHIFT);
+    uint64_t old_next = wheel_next_event(base);
+
+    timer->expires = expires;
+    timer->jiffy = ns_to_jiffy(expires);
+    timer->cpu = cpu;
+    timer->last_cpu = cpu;
+    wheel_add(base, timer);
+    int first = wheel_next_event(base) < old_next;
+    unlock(base->lock);
+
+    if (first && cpu == get_cpu_index()) {
+        lapic_timer_program_next(); // We're the new earliest event
+    }
+    interrupt_unlock(state);
+}
+
+/* Stop a timer, and wait for its callback if it's running. Returns 1 if the timer was still pending. */
+int ktimer_cancel(ktimer_t *timer) {
+    interrupt_state_t state = interrupt_lock();
+    int ret = ktimer_dequeue(timer);
+    interrupt_unlock(state);
+    asm volatile("" ::: "memory"); // Read running only after cpu, ktimer_run_expired stores them the other way round
+
+    if (timer->last_cpu != -1 && timer->last_cpu != get_cpu_index()) {
+        ktimer_base_t *base = per_cpu_ptr(ktimer_base, timer->last_cpu);
+        while (base->running == timer) { asm volatile("pause"); }
+    }
+    return ret;
+}
+
+/* Run the callbacks of every expired timer on this CPU, expects interrupts to be off */
+void ktimer_run_expired() {
+    ktimer_base_t *base = this_cpu_ptr(ktimer_base);
+    uint64_t now = get_time_ns() >> KTIMER_SHIFT;
+
+    lock(base->lock);
+    while (1) {
+        uint64_t jiffy = wheel_next_event(base);
+        if (jiffy > now) {
+            break;
+        }
+
+        base->clk = jiffy;
+        wheel_cascade(base, jiffy);
+
+        ktimer_t *timer;
+        while ((timer = base->slots[0][jiffy & KTIMER_WHEEL_MASK])) {
+            wheel_remove(base, timer);
+            if (timer->jiffy > jiffy) {
+                wheel_add(base, timer); // Was clamped to the end of the wheel
+                continue;
+            }
+
+            /* running goes up first, a cancel that sees cpu at -1 has to see it */
+            base->running = timer;
+            asm volatile("" ::: "memory");
+            timer->cpu = -1;
+            unlock(base->lock);
+
+            timer->callback(timer); // May restart the timer
+
+            lock(base->lock);
+            base->running = (void *) 0;
+        }
+        if (base->clk <= jiffy) {
+            base->clk = jiffy + 1; // A callback may have moved the clock already
+        }
+    }
+    if (base->clk <= now) {
+        base->clk = now + 1;
+    }
+    unlock(base->lock);
+}
+
+/* When this CPU next has to look at its timers, KTIMER_NONE if there are none */
+uint64_t ktimer_next_expiry() {
+    ktimer_base_t *base = this_cpu_ptr(ktimer_base);
+
+    lock(base->lock);
+    uint64_t jiffy = wheel_next_event(base);
+    unlock(base->lock);
+
+    return jiffy == 0xFFFFFFFFFFFFFFFF ? KTIMER_NONE : jiffy << KTIMER_SHIFT;
+}
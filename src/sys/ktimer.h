@@ -0,0 +1,48 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+#include <stdint.h>
+#include "klibc/lock.h"
+#include "sys/percpu.h"
+
+#define KTIMER_NONE 0xFFFFFFFFFFFFFFFF
+
+/* Timers live in a per-CPU hierarchical wheel. Time is counted in jiffies of 2^16 ns (~65us),
+   level 0 has a slot per jiffy and every level above is 64 times coarser. Timers are
+   cascaded down a level whenever the level below wraps around. */
+#define KTIMER_SHIFT 16
+#define KTIMER_WHEEL_BITS 6
+#define KTIMER_WHEEL_SIZE (1 << KTIMER_WHEEL_BITS)
+#define KTIMER_WHEEL_MASK (KTIMER_WHEEL_SIZE - 1)
+#define KTIMER_LEVELS 6 // Covers 2^36 jiffies, about 52 days
+#define KTIMER_MAX_DELTA ((1ULL << (KTIMER_LEVELS * KTIMER_WHEEL_BITS)) - 1)
+
+/* One-shot timer. The callback runs in interrupt context on the CPU the timer
+   was started on, never early and at most a jiffy late. */
+typedef struct ktimer {
+    struct ktimer *next; // Slot links
+    struct ktimer **pprev;
+    uint64_t expires; // ns since boot
+    uint64_t jiffy; // expires rounded up to a jiffy
+    uint16_t slot; // level * KTIMER_WHEEL_SIZE + index
+    void (*callback)(struct ktimer *timer);
+    volatile int cpu; // CPU the timer is queued on, -1 if it isn't queued
+    int last_cpu;
+} ktimer_t;
+
+typedef struct {
+    lock_t lock;
+    uint64_t clk; // Next jiffy to be processed
+    uint64_t pending[KTIMER_LEVELS]; // Bitmap of the slots that have timers
+    ktimer_t *slots[KTIMER_LEVELS][KTIMER_WHEEL_SIZE];
+    ktimer_t *volatile running; // Timer whose callback is running right now
+} ktimer_base_t;
+
+DECLARE_PER_CPU(ktimer_base_t, ktimer_base);
+
+void ktimer_init(ktimer_t *timer, void (*callback)(ktimer_t *timer));
+void ktimer_start(ktimer_t *timer, uint64_t expires);
+int ktimer_cancel(ktimer_t *timer);
+void ktimer_run_expired();
+uint64_t ktimer_next_expiry();
+
+#endif
@@ -0,0 +1,128 @@
+#include "lapic_timer.h"
+#include "apic.h"
+#include "smp.h"
+#include "ktimer.h"
+#include "timekeeping.h"
+#include "io/msr.h"
+#include "drivers/pit.h"
+#include "drivers/serial.h"
+#include "proc/scheduler.h"
+#include "proc/runqueue.h"
+#include <cpuid.h>
+
+DEFINE_PER_CPU(lapic_timer_t, lapic_timer);
+
+static uint8_t has_tsc_deadline() {
+    uint32_t a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return 0;
+    }
+    return (c >> 24) & 1;
+}
+
+/* Count how fast this CPU's LAPIC timer runs using the PIT ticks from the BSP,
+   then leave it in one-shot mode. Every event is programmed on demand after this. */
+void lapic_timer_init() {
+    lapic_timer_t *timer = this_cpu_ptr(lapic_timer);
+
+    write_lapic(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    write_lapic(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_LVT_MASKED);
+
+    /* Line up with a tick edge first */
+    uint64_t start = get_ticks();
+    while (get_ticks() == start) { asm volatile("pause"); }
+    start = get_ticks();
+
+    write_lapic(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    while (get_ticks() - start < LAPIC_CALIBRATION_MS) { asm volatile("pause"); }
+    uint32_t elapsed = 0xFFFFFFFF - read_lapic(LAPIC_TIMER_CURRENT);
+    write_lapic(LAPIC_TIMER_INITIAL, 0); // Stop it
+
+    timer->ticks_per_ms = elapsed / LAPIC_CALIBRATION_MS;
+    if (!timer->ticks_per_ms) {
+        sprintf("[LAPIC] Timer calibration failed on CPU %u, falling back to the PIT\n", (uint32_t) get_cpu_index());
+        return;
+    }
+
+    timer->tsc_deadline = has_tsc_deadline() && get_tsc_per_tick();
+    sprintf("[LAPIC] CPU %u timer runs at %u ticks/ms%s\n", (uint32_t) get_cpu_index(), timer->ticks_per_ms,
+        timer->tsc_deadline ? ", using TSC-deadline" : "");
+
+    if (timer->tsc_deadline) {
+        write_lapic(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_TSC_DEADLINE);
+    } else {
+        write_lapic(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_ONESHOT);
+    }
+    lapic_timer_program_next();
+}
+
+/* Fire the timer at a point in time (ns since boot), KTIMER_NONE turns it off */
+void lapic_timer_program(uint64_t deadline) {
+    lapic_timer_t *timer = this_cpu_ptr(lapic_timer);
+    if (!timer->ticks_per_ms) {
+        return;
+    }
+
+    if (deadline == KTIMER_NONE) {
+        if (timer->tsc_deadline) {
+            write_msr(IA32_TSC_DEADLINE, 0);
+        } else {
+            write_lapic(LAPIC_TIMER_INITIAL, 0);
+        }
+        return;
+    }
+
+    uint64_t now = get_time_ns();
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    if (delta > LAPIC_TIMER_MAX_SLEEP_NS) {
+        delta = LAPIC_TIMER_MAX_SLEEP_NS; // We'll just reprogram when it fires
+    }
+
+    if (timer->tsc_deadline) {
+        uint64_t tsc_delta = (delta * get_tsc_per_tick()) / NS_PER_TICK;
+        write_msr(IA32_TSC_DEADLINE, read_tsc() + tsc_delta + 1);
+    } else {
+        uint64_t count = (delta * timer->ticks_per_ms) / 1000000;
+        if (count == 0) {
+            count = 1;
+        } else if (count > 0xFFFFFFFF) {
+            count = 0xFFFFFFFF;
+        }
+        write_lapic(LAPIC_TIMER_INITIAL, (uint32_t) count);
+    }
+}
+
+/* Program the timer for the next thing this CPU has to do: the earliest ktimer,
+   or the end of the running thread's slice. Idle CPUs with nothing pending stay halted. */
+void lapic_timer_program_next() {
+    uint64_t next = ktimer_next_expiry();
+
+    if (scheduler_enabled) {
+        uint64_t slice_end = rq_slice_end(get_cpu_index(), get_cpu_locals()->current_thread);
+        if (slice_end < next) {
+            next = slice_end;
+        }
+    } else {
+        /* Poll until the scheduler is up */
+        uint64_t poll = get_time_ns() + sched_period * NS_PER_TICK;
+        if (poll < next) {
+            next = poll;
+        }
+    }
+
+    lapic_timer_program(next);
+}
+
+void lapic_timer_handler(int_reg_t *r) {
+    ktimer_run_expired();
+
+    if (scheduler_enabled) {
+        schedule_tick(r); // Programs the next event
+    } else {
+        lapic_timer_program_next();
+    }
+}
+
+uint8_t lapic_timer_enabled() {
+    return this_cpu_ptr(lapic_timer)->ticks_per_ms != 0;
+}
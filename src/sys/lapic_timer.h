@@ -0,0 +1,38 @@
+#ifndef LAPIC_TIMER_H
+#define LAPIC_TIMER_H
+#include <stdint.h>
+#include "sys/percpu.h"
+#include "sys/int/isr.h"
+
+#define LAPIC_TIMER_VECTOR 250
+
+/* LAPIC timer registers */
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_TIMER_ONESHOT (0 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define IA32_TSC_DEADLINE 0x6E0
+
+#define LAPIC_CALIBRATION_MS 10
+#define LAPIC_TIMER_MAX_SLEEP_NS 1000000000ULL // Longest we program at once, keeps the conversions from overflowing
+
+typedef struct {
+    uint32_t ticks_per_ms; // Calibrated against the PIT, 0 if the timer isn't usable
+    uint8_t tsc_deadline; // Use TSC-deadline mode instead of counting down
+} lapic_timer_t;
+
+DECLARE_PER_CPU(lapic_timer_t, lapic_timer);
+
+void lapic_timer_init();
+void lapic_timer_handler(int_reg_t *r);
+uint8_t lapic_timer_enabled();
+void lapic_timer_program(uint64_t deadline);
+void lapic_timer_program_next();
+
+#endif
@@ -0,0 +1,34 @@
+#include "percpu.h"
+#include "sys/smp.h"
+#include "klibc/stdlib.h"
+#include "klibc/string.h"
+
+extern char __percpu_start[];
+extern char __percpu_end[];
+
+uint64_t percpu_offsets[MAX_CPUS];
+uint32_t percpu_cpu_count = 0;
+
+/* Copy the per-CPU template for this CPU, expects the CPU locals to be setup */
+void percpu_init(uint8_t cpu_index) {
+    uint64_t size = (uint64_t) (__percpu_end - __percpu_start);
+    uint8_t *area = kcalloc(size ? size : 1);
+    memcpy((uint8_t *) __percpu_start, area, size);
+
+    uint64_t offset = (uint64_t) area - (uint64_t) __percpu_start;
+    get_cpu_locals()->percpu_offset = offset;
+    percpu_offsets[cpu_index] = offset;
+    atomic_inc(&percpu_cpu_count);
+}
+
+/* Sum a counter over every CPU, the result is only a snapshot */
+uint64_t percpu_counter_sum_template(percpu_counter_t *counter) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < MAX_CPUS; i++) {
+        if (percpu_offsets[i]) {
+            percpu_counter_t *cpu_counter = (percpu_counter_t *) ((uint64_t) counter + percpu_offsets[i]);
+            total += cpu_counter->count;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,51 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+#include <stdint.h>
+#include "klibc/lock.h"
+
+#define MAX_CPUS 256
+#define CACHE_LINE_SIZE 64
+
+/* Per-CPU variables live in the .percpu section, which is only a template.
+   Every CPU gets its own copy at boot, and the offset from the template to
+   that copy is kept in the CPU locals at gs:32. */
+#define DEFINE_PER_CPU(type, name) \
+    __attribute__((section(".percpu"))) __typeof__(type) percpu_##name
+#define DECLARE_PER_CPU(type, name) \
+    extern __attribute__((section(".percpu"))) __typeof__(type) percpu_##name
+
+#define this_cpu_ptr(name) \
+    ((__typeof__(&percpu_##name)) ((uint64_t) &percpu_##name + this_cpu_offset()))
+#define per_cpu_ptr(name, cpu) \
+    ((__typeof__(&percpu_##name)) ((uint64_t) &percpu_##name + percpu_offsets[(cpu)]))
+
+/* Counters get a cache line each so they never share a line with anything hot */
+typedef struct {
+    uint64_t count;
+} __attribute__((aligned(CACHE_LINE_SIZE))) percpu_counter_t;
+
+#define DEFINE_PER_CPU_COUNTER(name) DEFINE_PER_CPU(percpu_counter_t, name)
+#define DECLARE_PER_CPU_COUNTER(name) DECLARE_PER_CPU(percpu_counter_t, name)
+
+#define percpu_counter_add(name, value) do { \
+    interrupt_state_t percpu_state_ = interrupt_lock(); \
+    this_cpu_ptr(name)->count += (value); \
+    interrupt_unlock(percpu_state_); \
+} while (0)
+#define percpu_counter_inc(name) percpu_counter_add(name, 1)
+#define percpu_counter_sum(name) percpu_counter_sum_template(&percpu_##name)
+#define percpu_counter_read(name, cpu) (per_cpu_ptr(name, cpu)->count)
+
+static inline uint64_t this_cpu_offset() {
+    uint64_t offset;
+    asm volatile("movq %%gs:32, %0;" : "=r"(offset));
+    return offset;
+}
+
+void percpu_init(uint8_t cpu_index);
+uint64_t percpu_counter_sum_template(percpu_counter_t *counter);
+
+extern uint64_t percpu_offsets[MAX_CPUS];
+extern uint32_t percpu_cpu_count;
+
+#endif
@@ -2,6 +2,10 @@
 #include "mm/vmm.h"
 #include "io/msr.h"
 #include "sys/apic.h"
+#include "sys/percpu.h"
+#include "sys/lapic_timer.h"
+#include "sys/topology.h"
+#include "proc/fpu.h"
 #include "klibc/stdlib.h"
 #include "klibc/string.h"
 #include "klibc/hashmap.h"
@@ -114,6 +118,7 @@ void smp_entry_point() {
     cpu_locals->apic_id = get_lapic_id();
     cpu_locals->cpu_index = *(uint8_t *) (0x560 + NORMAL_VMA_OFFSET);
     hashmap_set_elem(cpu_locals_list, get_cpu_index(), cpu_locals);
+    percpu_init(cpu_locals->cpu_index);
 
     load_tss();
     set_panic_stack((uint64_t) kmalloc(0x1000) + 0x1000);
@@ -122,6 +127,9 @@ void smp_entry_point() {
     configure_apic_ap();
     scheduler_init_ap();
     configure_idt();
+    lapic_timer_init();
+    fpu_init_cpu();
+    topology_init_cpu();
 
     /* After init, let the BSP know that we are done */
     *GET_HIGHER_HALF(uint16_t *, 0x500) = 2;
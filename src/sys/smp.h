@@ -11,10 +11,12 @@ typedef struct {
     uint64_t thread_kernel_stack;
     uint64_t thread_user_stack;
     uint64_t in_irq;
+    uint64_t percpu_offset; // Offset from the .percpu template to this CPU's copy
     /* Change these ig lol */
     uint8_t apic_id;
     uint8_t cpu_index;
     thread_t *current_thread;
+    thread_t *idle_thread;
     int64_t pid;
     int64_t tid;
     int64_t idle_tid; // The TID for this CPUs idle task
@@ -34,6 +36,7 @@ typedef struct {
     tss_64_t tss;
 
     uint8_t ignore_ring;
+    volatile uint8_t need_resched; // Switch threads at the next chance
 } __attribute__((packed)) cpu_locals_t;
 
 hashmap_t *cpu_locals_list;
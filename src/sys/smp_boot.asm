@@ -46,7 +46,7 @@ loaded_compatability_mode:
     mov ds, ax
     mov es, ax
     mov ss, ax
-    mov ax, 0x20
+    mov ax, 0x18 ; User data
     mov gs, ax
     mov fs, ax
 
@@ -0,0 +1,127 @@
+#include "timekeeping.h"
+#include "io/msr.h"
+#include "drivers/pit.h"
+#include "drivers/rtc.h"
+#include "drivers/serial.h"
+#include <cpuid.h>
+
+timekeeper_t timekeeper = {{0, {0, 0, 0, 0}}, 0, 0, 0, 0, 0};
+
+/* Called from the timer interrupt on every tick */
+void timekeeping_tick() {
+    if (timekeeper.tickless) {
+        return; // Last interrupt from the PIT as it stops
+    }
+    write_seqlock(&timekeeper.lock);
+    timekeeper.ticks++;
+    timekeeper.tsc_base = read_tsc();
+    write_sequnlock(&timekeeper.lock);
+}
+
+/* Read the RTC once and calibrate the TSC against the timer, needs the timer running */
+void timekeeping_init() {
+    uint64_t epoch = rtc_get_time_since_epoch();
+
+    /* Line up with a tick edge first */
+    uint64_t start_ticks = get_ticks();
+    while (get_ticks() == start_ticks) { asm volatile("pause"); }
+
+    uint64_t start_tsc = read_tsc();
+    sleep_no_task(50);
+    uint64_t tsc_per_tick = (read_tsc() - start_tsc) / 50;
+
+    /* The tick takes the write side too, it can't come in while we hold it */
+    interrupt_state_t state = interrupt_lock();
+    write_seqlock(&timekeeper.lock);
+    timekeeper.tsc_per_tick = tsc_per_tick;
+    timekeeper.boot_epoch = epoch - (timekeeper.ticks / TIMER_HZ);
+    write_sequnlock(&timekeeper.lock);
+    interrupt_unlock(state);
+
+    sprintf("[Time] TSC runs at %lu ticks per ms, epoch %lu\n", tsc_per_tick, epoch);
+}
+
+/* Does the TSC tick at the same rate in every P-state and C-state, and so on every CPU */
+static int tsc_invariant() {
+    uint32_t a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) {
+        return 0;
+    }
+    return (d >> 8) & 1;
+}
+
+/* Stop the PIT once every CPU has its own timer, the TSC carries on from the last tick */
+void timekeeping_stop_tick() {
+    if (!timekeeper.tsc_per_tick) {
+        return; // Nothing to keep time with
+    }
+    if (!tsc_invariant()) {
+        /* It could drift with frequency changes or between CPUs, the tick keeps it in line */
+        sprintf("[Time] TSC isn't invariant, keeping the PIT\n");
+        return;
+    }
+
+    interrupt_state_t state = interrupt_lock(); // The PIT is still ticking
+    write_seqlock(&timekeeper.lock);
+    timekeeper.tickless = 1;
+    write_sequnlock(&timekeeper.lock);
+    interrupt_unlock(state);
+    pit_stop();
+
+    sprintf("[Time] Stopped the PIT, running tickless\n");
+}
+
+uint64_t get_ticks() {
+    if (timekeeper.tickless) {
+        return get_time_ns() / NS_PER_TICK;
+    }
+
+    uint64_t ticks;
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&timekeeper.lock);
+        ticks = timekeeper.ticks;
+    } while (read_seqretry(&timekeeper.lock, seq));
+    return ticks;
+}
+
+/* Nanoseconds since boot, interpolated between ticks with the TSC */
+uint64_t get_time_ns() {
+    uint64_t ticks, tsc_base, tsc_per_tick;
+    uint8_t tickless;
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&timekeeper.lock);
+        ticks = timekeeper.ticks;
+        tsc_base = timekeeper.tsc_base;
+        tsc_per_tick = timekeeper.tsc_per_tick;
+        tickless = timekeeper.tickless;
+    } while (read_seqretry(&timekeeper.lock, seq));
+
+    uint64_t ns = ticks * NS_PER_TICK;
+    if (tsc_per_tick) {
+        uint64_t now = read_tsc();
+        uint64_t delta = now > tsc_base ? now - tsc_base : 0;
+        if (!tickless && delta >= tsc_per_tick) {
+            delta = tsc_per_tick - 1; // Never run ahead of the next tick
+        }
+        ns += tsc_to_ns(delta);
+    }
+    return ns;
+}
+
+uint64_t get_time_since_epoch() {
+    return timekeeper.boot_epoch + (get_ticks() / TIMER_HZ);
+}
+
+uint64_t get_tsc_per_tick() {
+    return timekeeper.tsc_per_tick;
+}
+
+uint64_t tsc_to_ns(uint64_t tsc) {
+    uint64_t tsc_per_tick = timekeeper.tsc_per_tick;
+    if (!tsc_per_tick) {
+        return 0;
+    }
+    return (tsc / tsc_per_tick) * NS_PER_TICK + ((tsc % tsc_per_tick) * NS_PER_TICK) / tsc_per_tick;
+}
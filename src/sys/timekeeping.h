@@ -0,0 +1,31 @@
+#ifndef TIMEKEEPING_H
+#define TIMEKEEPING_H
+#include <stdint.h>
+#include "klibc/seqlock.h"
+
+#define TIMER_HZ 1000
+#define NS_PER_TICK (1000000000 / TIMER_HZ)
+
+typedef struct {
+    seqlock_t lock;
+
+    uint64_t ticks; // Timer ticks since boot
+    uint64_t tsc_base; // TSC value at the last tick
+    uint64_t tsc_per_tick; // Calibrated TSC frequency (0 until calibrated)
+    uint64_t boot_epoch; // Seconds since the epoch when we started counting ticks
+    uint8_t tickless; // The PIT is stopped, time only comes from the TSC
+} timekeeper_t;
+
+void timekeeping_init();
+void timekeeping_tick();
+void timekeeping_stop_tick();
+
+uint64_t get_ticks();
+uint64_t get_time_ns();
+uint64_t get_time_since_epoch();
+uint64_t get_tsc_per_tick();
+uint64_t tsc_to_ns(uint64_t tsc);
+
+extern timekeeper_t timekeeper;
+
+#endif
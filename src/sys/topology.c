@@ -0,0 +1,129 @@
+#include "topology.h"
+#include "sys/smp.h"
+#include "sys/apic.h"
+#include "sys/cpu_index.h"
+#include "klibc/lock.h"
+#include "drivers/serial.h"
+#include <cpuid.h>
+
+DEFINE_PER_CPU(cpu_topology_t, cpu_topology);
+
+static lock_t topology_lock = {0, 0, 0, 0};
+
+static uint32_t count_to_shift(uint32_t count) {
+    uint32_t shift = 0;
+    while ((1U << shift) < count) {
+        shift++;
+    }
+    return shift;
+}
+
+/* Work out how many low APIC ID bits pick the thread within a core, the core within
+   a package, and the CPUs behind one last level cache */
+static void topology_read_cpuid(cpu_topology_t *topo) {
+    uint32_t a, b, c, d;
+    uint32_t max_leaf = __get_cpuid_max(0, (void *) 0);
+    uint32_t smt_shift = 0;
+    uint32_t pkg_shift = 0;
+    int have_leaf_b = 0;
+
+    if (max_leaf >= 0xB) {
+        __cpuid_count(0xB, 0, a, b, c, d);
+        if (b) {
+            have_leaf_b = 1;
+            topo->apic_id = d;
+            for (uint32_t level = 0; level < 8; level++) {
+                __cpuid_count(0xB, level, a, b, c, d);
+                uint32_t type = (c >> 8) & 0xFF;
+                if (!type) {
+                    break;
+                } else if (type == 1) {
+                    smt_shift = a & 0x1F;
+                } else if (type == 2) {
+                    pkg_shift = a & 0x1F;
+                }
+            }
+        }
+    }
+
+    if (!have_leaf_b) {
+        /* Older CPUs, count logical CPUs (if HTT is set) and cores per package instead */
+        __cpuid(1, a, b, c, d);
+        uint32_t logical = (d & (1 << 28)) ? (b >> 16) & 0xFF : 1;
+        uint32_t cores = 1;
+        if (max_leaf >= 4) {
+            __cpuid_count(4, 0, a, b, c, d);
+            if (a & 0x1F) {
+                cores = (a >> 26) + 1;
+            }
+        }
+        pkg_shift = count_to_shift(logical);
+        smt_shift = cores < logical ? count_to_shift(logical / cores) : 0;
+    }
+    if (pkg_shift < smt_shift) {
+        pkg_shift = smt_shift;
+    }
+
+    /* The deepest data or unified cache is the LLC, assume one per package if we can't tell */
+    uint32_t llc_shift = pkg_shift;
+    if (max_leaf >= 4) {
+        uint32_t llc_level = 0;
+        for (uint32_t i = 0; i < 16; i++) {
+            __cpuid_count(4, i, a, b, c, d);
+            uint32_t type = a & 0x1F;
+            uint32_t level = (a >> 5) & 0x7;
+            if (!type) {
+                break;
+            }
+            if (type != 2 && level > llc_level) { // 2 is an instruction cache
+                llc_level = level;
+                llc_shift = count_to_shift(((a >> 14) & 0xFFF) + 1);
+            }
+        }
+    }
+
+    topo->core_id = topo->apic_id >> smt_shift;
+    topo->package_id = topo->apic_id >> pkg_shift;
+    topo->llc_id = topo->apic_id >> llc_shift;
+}
+
+/* Fill in this CPU's topology and add it to the domains of every CPU that's up */
+void topology_init_cpu() {
+    int cpu = get_cpu_index();
+    cpu_topology_t *topo = this_cpu_ptr(cpu_topology);
+    topo->apic_id = get_lapic_id();
+    topology_read_cpuid(topo);
+
+    for (uint64_t i = 0; i < cpu_vector.items_count; i++) {
+        madt_ent0_t *ent = cpu_vector.items[i];
+        if (ent->apic_id == get_lapic_id()) {
+            topo->acpi_id = ent->acpi_processor_id;
+            break;
+        }
+    }
+
+    lock(topology_lock);
+    for (int level = 0; level < TOPO_LEVELS; level++) {
+        cpumask_clear(&topo->masks[level]);
+    }
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!percpu_offsets[i]) {
+            continue;
+        }
+        cpu_topology_t *other = per_cpu_ptr(cpu_topology, i);
+        int shared[TOPO_LEVELS];
+        shared[TOPO_SMT] = other->core_id == topo->core_id && other->package_id == topo->package_id;
+        shared[TOPO_LLC] = other->llc_id == topo->llc_id && other->package_id == topo->package_id;
+        shared[TOPO_ALL] = 1;
+        for (int level = 0; level < TOPO_LEVELS; level++) {
+            if (shared[level] || i == cpu) {
+                cpumask_set_cpu(&topo->masks[level], i);
+                cpumask_set_cpu(&other->masks[level], cpu);
+            }
+        }
+    }
+    unlock(topology_lock);
+
+    sprintf("[Topology] CPU %d: APIC %u, ACPI %u, core %u, package %u, LLC %u\n", cpu, topo->apic_id,
+        (uint32_t) topo->acpi_id, topo->core_id, topo->package_id, topo->llc_id);
+}
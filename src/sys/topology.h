@@ -0,0 +1,35 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+#include <stdint.h>
+#include "sys/percpu.h"
+#include "sys/cpumask.h"
+
+/* Scheduling domains, from the CPUs closest to each other out */
+#define TOPO_SMT 0 // Hyperthreads of one core
+#define TOPO_LLC 1 // Cores sharing the last level cache
+#define TOPO_ALL 2 // Everything that's online
+#define TOPO_LEVELS 3
+
+typedef struct {
+    uint32_t apic_id; // x2APIC ID if CPUID has it, the xAPIC ID otherwise
+    uint8_t acpi_id; // ACPI processor ID from the MADT
+    uint32_t core_id;
+    uint32_t package_id;
+    uint32_t llc_id;
+    cpumask_t masks[TOPO_LEVELS]; // Other CPUs in each domain, including this one
+} cpu_topology_t;
+
+DECLARE_PER_CPU(cpu_topology_t, cpu_topology);
+
+void topology_init_cpu();
+
+static inline cpumask_t *topology_mask(int cpu, int level) {
+    return &per_cpu_ptr(cpu_topology, cpu)->masks[level];
+}
+
+/* Do two CPUs share a cache, so moving a thread between them is cheap */
+static inline int cpus_share_cache(int a, int b) {
+    return cpumask_test_cpu(topology_mask(a, TOPO_LLC), b);
+}
+
+#endif